@@ -1,108 +1,921 @@
 #pragma once
 
 #include <WiFi.h>
+#include <WiFiUdp.h>
 #include <AsyncTCP.h>
 #include <ESPAsyncWebServer.h>
 #include <Adafruit_NeoPixel.h>
 #include <ArduinoJson.h>
+#include <Preferences.h>
+#include <stdarg.h>
+#include <atomic>
 
-#define COMMANDS_PER_LOOP 10
-#define DEBUG_LOGGING true
+#include "NeopixelCommanderCore.h"
+#include "NeopixelCommanderParser.h"
 
-enum CommandType
+#if __has_include(<driver/rmt.h>)
+#include <driver/rmt.h>
+#define NEOPIXEL_COMMANDER_HAS_RMT 1
+#endif
+
+// Log level, lower levels are compiled out entirely. 0 disables logging.
+#define NEOPIXEL_LOG_LEVEL_NONE 0
+#define NEOPIXEL_LOG_LEVEL_ERROR 1
+#define NEOPIXEL_LOG_LEVEL_WARN 2
+#define NEOPIXEL_LOG_LEVEL_INFO 3
+#define NEOPIXEL_LOG_LEVEL_DEBUG 4
+#ifndef NEOPIXEL_LOG_LEVEL
+#define NEOPIXEL_LOG_LEVEL NEOPIXEL_LOG_LEVEL_INFO
+#endif
+
+// Log sink: lines are queued in LOG_BUFFER_SIZE bytes and written to Serial
+// by a low priority task, at most LOG_RATE lines per second with bursts of
+// LOG_BURST. Lines are cut at LOG_LINE_SIZE characters.
+#ifndef LOG_BUFFER_SIZE
+#define LOG_BUFFER_SIZE 2048
+#endif
+#ifndef LOG_LINE_SIZE
+#define LOG_LINE_SIZE 128
+#endif
+#ifndef LOG_RATE
+#define LOG_RATE 50
+#endif
+#ifndef LOG_BURST
+#define LOG_BURST 20
+#endif
+#ifndef LOG_TASK_STACK_SIZE
+#define LOG_TASK_STACK_SIZE 3072
+#endif
+#ifndef LOG_TASK_PRIORITY
+#define LOG_TASK_PRIORITY 1
+#endif
+#ifndef LOG_FLUSH_INTERVAL_MS
+#define LOG_FLUSH_INTERVAL_MS 20
+#endif
+
+// Default time loop() may spend executing queued commands, see
+// NeopixelCommander::setDrainBudget()
+#ifndef DRAIN_BUDGET_US
+#define DRAIN_BUDGET_US 2000
+#endif
+
+// Size of the document incoming JSON commands are parsed into. Each element
+// of a setPixels "colors" array takes 16 bytes, prefer "hex" for long runs.
+#ifndef JSON_DOCUMENT_SIZE
+#define JSON_DOCUMENT_SIZE 1024
+#endif
+
+// Acks collected per drain in ACK_BATCH/ACK_UP_TO mode
+#ifndef ACK_BATCH_CLIENTS
+#define ACK_BATCH_CLIENTS 8
+#endif
+#ifndef ACK_BATCH_SIZE
+#define ACK_BATCH_SIZE 32
+#endif
+
+// Pool for WebSocket messages that arrive in several pieces. Each slot holds
+// one message of up to REASSEMBLY_BUFFER_SIZE bytes while it is reassembled.
+#ifndef REASSEMBLY_SLOTS
+#define REASSEMBLY_SLOTS 2
+#endif
+#ifndef REASSEMBLY_BUFFER_SIZE
+#define REASSEMBLY_BUFFER_SIZE 4096
+#endif
+
+// Clients whose message rate is tracked for the stats
+#ifndef STATS_MAX_CLIENTS
+#define STATS_MAX_CLIENTS 8
+#endif
+
+// UDP streaming input, see NeopixelCommander::enableDdp() and friends
+#define DDP_PORT 4048
+#define E131_PORT 5568
+#define ARTNET_PORT 6454
+#define DMX_PIXELS_PER_UNIVERSE 170
+#ifndef UDP_BUFFER_SIZE
+#define UDP_BUFFER_SIZE 1460
+#endif
+#ifndef UDP_PACKETS_PER_POLL
+#define UDP_PACKETS_PER_POLL 16
+#endif
+
+// On-device effects
+#ifndef MAX_EFFECTS
+#define MAX_EFFECTS 4
+#endif
+#ifndef MAX_PALETTE_SIZE
+#define MAX_PALETTE_SIZE 8
+#endif
+#ifndef MAX_TRANSITIONS
+#define MAX_TRANSITIONS 4
+#endif
+// Frame interval of effects and transitions when running from loop()
+#ifndef EFFECT_FRAME_INTERVAL_MS
+#define EFFECT_FRAME_INTERVAL_MS 20
+#endif
+
+// Timestamped commands waiting for their time, and how far ahead they may be
+#ifndef SCHEDULE_SIZE
+#define SCHEDULE_SIZE 64
+#endif
+#ifndef SCHEDULE_MAX_AHEAD_MS
+#define SCHEDULE_MAX_AHEAD_MS 60000
+#endif
+
+// Fair queuing: each WebSocket client gets its own sub-queue, drained round
+// robin with the shared queue. Clients beyond CLIENT_QUEUES and HTTP use the
+// shared queue. CLIENT_QUEUE_SIZE is the default, see QueueConfig.
+#ifndef CLIENT_QUEUES
+#define CLIENT_QUEUES 4
+#endif
+
+// How many pending pixel writes a full fill may drop, at most ACK_BATCH_SIZE
+#ifndef COALESCE_WINDOW
+#define COALESCE_WINDOW 16
+#endif
+
+// Maximum number of strips driven by one controller. The binary protocol
+// carries the strip in four bits, so this can be at most 16.
+#ifndef MAX_STRIPS
+#define MAX_STRIPS 8
+#endif
+static_assert(MAX_STRIPS <= 16, "strip numbers must fit the high nibble of the binary flags");
+
+// Named pixel ranges, see NeopixelCommander::addSegment(). At most 15.
+#ifndef MAX_SEGMENTS
+#define MAX_SEGMENTS 8
+#endif
+#ifndef SEGMENT_NAME_SIZE
+#define SEGMENT_NAME_SIZE 16
+#endif
+
+// Render task settings, see NeopixelCommander::setRenderTask()
+#ifndef RENDER_TASK_STACK_SIZE
+#define RENDER_TASK_STACK_SIZE 4096
+#endif
+#ifndef RENDER_TASK_PRIORITY
+#define RENDER_TASK_PRIORITY 2
+#endif
+#ifndef RENDER_TASK_CORE
+#if portNUM_PROCESSORS < 2
+#define RENDER_TASK_CORE 0
+#elif defined(CONFIG_ASYNC_TCP_RUNNING_CORE) && CONFIG_ASYNC_TCP_RUNNING_CORE >= 0
+#define RENDER_TASK_CORE (1 - CONFIG_ASYNC_TCP_RUNNING_CORE)
+#else
+// AsyncTCP is not pinned, keep away from the Arduino loop core
+#define RENDER_TASK_CORE (1 - ARDUINO_RUNNING_CORE)
+#endif
+#endif
+
+#if NEOPIXEL_LOG_LEVEL > NEOPIXEL_LOG_LEVEL_NONE
+// Lines are formatted by the caller into a ring buffer and written to Serial
+// by a task of its own, so logging from the AsyncTCP task or the render task
+// never waits for the UART. Lines over the rate limit or that do not fit are
+// dropped and counted.
+class NeopixelLog
+{
+public:
+  static NeopixelLog &instance()
+  {
+    static NeopixelLog sink;
+    return sink;
+  }
+
+  // Starts the task that writes the lines, until then they are only queued
+  void begin()
+  {
+    if (_task == nullptr)
+      xTaskCreate(_taskEntry, "neopixelLog", LOG_TASK_STACK_SIZE, this, LOG_TASK_PRIORITY, &_task);
+  }
+
+  __attribute__((format(printf, 2, 3))) void print(const char *format, ...)
+  {
+    char line[LOG_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len <= 0)
+      return;
+    if (len >= (int)sizeof(line))
+    {
+      len = sizeof(line) - 1;
+      line[len - 1] = '\n';
+    }
+
+    portENTER_CRITICAL(&_lock);
+    uint16_t used = (_head + LOG_BUFFER_SIZE - _tail) % LOG_BUFFER_SIZE;
+    if (len < LOG_BUFFER_SIZE - used && _takeToken())
+    {
+      uint16_t first = LOG_BUFFER_SIZE - _head < len ? LOG_BUFFER_SIZE - _head : len;
+      memcpy(_buffer + _head, line, first);
+      memcpy(_buffer, line + first, len - first);
+      _head = (_head + len) % LOG_BUFFER_SIZE;
+    }
+    else
+    {
+      _dropped++;
+    }
+    portEXIT_CRITICAL(&_lock);
+  }
+
+  // Writes the queued lines to Serial, e.g. before a restart
+  void flush()
+  {
+    char chunk[64];
+    for (;;)
+    {
+      size_t n = 0;
+      portENTER_CRITICAL(&_lock);
+      uint32_t dropped = _dropped;
+      _dropped = 0;
+      for (; n < sizeof(chunk) && _tail != _head; ++n)
+      {
+        chunk[n] = _buffer[_tail];
+        _tail = (_tail + 1) % LOG_BUFFER_SIZE;
+      }
+      portEXIT_CRITICAL(&_lock);
+
+      if (dropped)
+        Serial.printf("(%u log lines dropped)\n", dropped);
+      if (n == 0)
+        return;
+      Serial.write((const uint8_t *)chunk, n);
+    }
+  }
+
+private:
+  static void _taskEntry(void *arg)
+  {
+    for (;;)
+    {
+      vTaskDelay(pdMS_TO_TICKS(LOG_FLUSH_INTERVAL_MS));
+      static_cast<NeopixelLog *>(arg)->flush();
+    }
+  }
+
+  // Same scheme as the client rate limit, in 1/1000 lines
+  bool _takeToken()
+  {
+    uint32_t now = millis();
+    uint32_t elapsed = now - _refilledMs;
+    if (elapsed > 0xffff)
+      elapsed = 0xffff;
+    _refilledMs = now;
+    _tokens += elapsed * LOG_RATE;
+    if (_tokens > LOG_BURST * 1000)
+      _tokens = LOG_BURST * 1000;
+    if (_tokens < 1000)
+      return false;
+    _tokens -= 1000;
+    return true;
+  }
+
+  char _buffer[LOG_BUFFER_SIZE];
+  uint16_t _head = 0;
+  uint16_t _tail = 0;
+  uint32_t _dropped = 0;
+  uint32_t _tokens = LOG_BURST * 1000;
+  uint32_t _refilledMs = 0;
+  TaskHandle_t _task = nullptr;
+  portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+};
+#endif
+
+// NEOPIXEL_LOG_INFO("Connected as %s\n", ip) and friends, printf style
+#if NEOPIXEL_LOG_LEVEL >= NEOPIXEL_LOG_LEVEL_ERROR
+#define NEOPIXEL_LOG_ERROR(...) NeopixelLog::instance().print(__VA_ARGS__)
+#else
+#define NEOPIXEL_LOG_ERROR(...) ((void)0)
+#endif
+#if NEOPIXEL_LOG_LEVEL >= NEOPIXEL_LOG_LEVEL_WARN
+#define NEOPIXEL_LOG_WARN(...) NeopixelLog::instance().print(__VA_ARGS__)
+#else
+#define NEOPIXEL_LOG_WARN(...) ((void)0)
+#endif
+#if NEOPIXEL_LOG_LEVEL >= NEOPIXEL_LOG_LEVEL_INFO
+#define NEOPIXEL_LOG_INFO(...) NeopixelLog::instance().print(__VA_ARGS__)
+#else
+#define NEOPIXEL_LOG_INFO(...) ((void)0)
+#endif
+#if NEOPIXEL_LOG_LEVEL >= NEOPIXEL_LOG_LEVEL_DEBUG
+#define NEOPIXEL_LOG_DEBUG(...) NeopixelLog::instance().print(__VA_ARGS__)
+#else
+#define NEOPIXEL_LOG_DEBUG(...) ((void)0)
+#endif
+
+// Default output, bit-bangs through Adafruit_NeoPixel. show() blocks with
+// interrupts disabled until the whole strip is sent.
+class AdafruitNeopixelOutput : public NeopixelOutput
 {
-  SET_PIXEL_COLOR,
-  SET_COLOR,
-  CLEAR,
-  SHOW,
-  SET_BRIGHTNESS
+public:
+  AdafruitNeopixelOutput(uint8_t pin, uint16_t numPixels, neoPixelType type = NEO_GRB + NEO_KHZ800)
+      : _strip(numPixels, pin, type) {}
+
+  bool begin(uint8_t pin, uint16_t numPixels) override
+  {
+    if (_strip.numPixels() != numPixels)
+      _strip.updateLength(numPixels);
+    if (_strip.getPin() != pin)
+      _strip.setPin(pin);
+    _strip.begin();
+    return _strip.getPixels() != nullptr;
+  }
+
+  uint8_t *pixels() override { return _strip.getPixels(); }
+
+  void show() override
+  {
+    _strip.show();
+    _showComplete();
+  }
+
+private:
+  Adafruit_NeoPixel _strip;
 };
 
-struct Command
+#if NEOPIXEL_COMMANDER_HAS_RMT
+// WS2812 output through the ESP32 RMT peripheral. show() queues the frame and
+// returns immediately, the bits are generated by the RMT driver from its
+// interrupt while the CPU keeps serving WiFi and the command queue.
+class RmtNeopixelOutput : public NeopixelOutput
 {
-  CommandType type;
-  uint16_t index;
-  uint8_t r;
-  uint8_t g;
-  uint8_t b;
-  uint8_t brightness;
-  uint32_t clientId;
-  uint32_t commandId; // unique ID for this command
+public:
+  explicit RmtNeopixelOutput(rmt_channel_t channel = RMT_CHANNEL_0) : _channel(channel) {}
+
+  ~RmtNeopixelOutput() override
+  {
+    _uninstall();
+    delete[] _pixels;
+  }
+
+  // May be called again, e.g. with a new size, the channel is set up anew
+  bool begin(uint8_t pin, uint16_t numPixels) override
+  {
+    _uninstall();
+    delete[] _pixels;
+    _size = numPixels * 3;
+    _pixels = new uint8_t[_size]();
+
+    rmt_config_t config = RMT_DEFAULT_CONFIG_TX((gpio_num_t)pin, _channel);
+    config.clk_div = 2; // 40 MHz, 25 ns per tick
+    if (rmt_config(&config) != ESP_OK || rmt_driver_install(_channel, 0, 0) != ESP_OK)
+      return false;
+    _installed = true;
+
+    uint32_t clockHz = 0;
+    rmt_get_counter_clock(_channel, &clockHz);
+    float ticksPerNs = clockHz / 1e9f;
+    _bit0.level0 = 1;
+    _bit0.duration0 = T0H_NS * ticksPerNs;
+    _bit0.level1 = 0;
+    _bit0.duration1 = T0L_NS * ticksPerNs;
+    _bit1.level0 = 1;
+    _bit1.duration0 = T1H_NS * ticksPerNs;
+    _bit1.level1 = 0;
+    _bit1.duration1 = T1L_NS * ticksPerNs;
+
+    rmt_translator_init(_channel, _translate);
+    rmt_translator_set_context(_channel, this);
+
+    // The driver only supports a single callback for all channels
+    _instances()[_channel] = this;
+    rmt_register_tx_end_callback(_onTxEnd, nullptr);
+    return true;
+  }
+
+  uint8_t *pixels() override { return _pixels; }
+
+  void show() override
+  {
+    waitDone();
+    _busy = true;
+    rmt_write_sample(_channel, _pixels, _size, false);
+  }
+
+  // WS2812 pixels keep their color until new data reaches them, so sending
+  // up to the last changed pixel is enough
+  void showRange(uint16_t first, uint16_t count) override
+  {
+    waitDone();
+    _busy = true;
+    rmt_write_sample(_channel, _pixels, (first + count) * 3, false);
+  }
+
+  bool busy() override
+  {
+    return _busy || micros() - _doneAtUs < LATCH_US;
+  }
+
+  void waitDone() override
+  {
+    if (_busy)
+      rmt_wait_tx_done(_channel, portMAX_DELAY);
+    while (busy())
+      ;
+  }
+
+private:
+  // WS2812B timings
+  static const uint16_t T0H_NS = 400;
+  static const uint16_t T0L_NS = 850;
+  static const uint16_t T1H_NS = 800;
+  static const uint16_t T1L_NS = 450;
+  static const uint32_t LATCH_US = 300;
+
+  // Function local so the header can be included from several files
+  static RmtNeopixelOutput **_instances()
+  {
+    static RmtNeopixelOutput *instances[RMT_CHANNEL_MAX] = {};
+    return instances;
+  }
+
+  // Waits for the last frame and releases the channel
+  void _uninstall()
+  {
+    if (!_installed)
+      return;
+    rmt_wait_tx_done(_channel, portMAX_DELAY);
+    rmt_driver_uninstall(_channel);
+    _instances()[_channel] = nullptr;
+    _installed = false;
+    _busy = false;
+  }
+
+  rmt_channel_t _channel;
+  bool _installed = false;
+  uint8_t *_pixels = nullptr;
+  size_t _size = 0;
+  rmt_item32_t _bit0 = {};
+  rmt_item32_t _bit1 = {};
+  volatile bool _busy = false;
+  volatile uint32_t _doneAtUs = 0;
+
+  static void IRAM_ATTR _onTxEnd(rmt_channel_t channel, void *)
+  {
+    RmtNeopixelOutput *self = _instances()[channel];
+    if (self == nullptr)
+      return;
+    self->_doneAtUs = micros();
+    self->_busy = false;
+    self->_showComplete();
+  }
+
+  // Converts pixel bytes into RMT items, MSB first, called by the driver
+  static void IRAM_ATTR _translate(const void *src, rmt_item32_t *dest, size_t srcSize,
+                                   size_t wantedNum, size_t *translatedSize, size_t *itemNum)
+  {
+    if (src == nullptr || dest == nullptr)
+    {
+      *translatedSize = 0;
+      *itemNum = 0;
+      return;
+    }
+    RmtNeopixelOutput *self = nullptr;
+    rmt_translator_get_context(itemNum, (void **)&self);
+
+    const uint8_t *in = (const uint8_t *)src;
+    size_t size = 0;
+    size_t num = 0;
+    while (size < srcSize && num + 8 <= wantedNum)
+    {
+      uint8_t value = *in++;
+      for (uint8_t bit = 0; bit < 8; ++bit, value <<= 1)
+        (dest++)->val = (value & 0x80) ? self->_bit1.val : self->_bit0.val;
+      num += 8;
+      size++;
+    }
+    *translatedSize = size;
+    *itemNum = num;
+  }
 };
+#endif
 
 class NeopixelCommander
 {
 public:
-  NeopixelCommander(const char *ssid, const char *password, uint8_t pin, uint16_t numPixels, uint16_t brightness)
-      : _ssid(ssid), _password(password), _pin(pin), _numPixels(numPixels),
-        _server(80), _ws("/ws"), _strip(numPixels, pin, NEO_GRB + NEO_KHZ800),
-        _connectTimeoutMs(15000) {
-    _strip.setBrightness(brightness);
+  NeopixelCommander(const char *ssid, const char *password, uint8_t pin, uint16_t numPixels, uint16_t brightness,
+                    const ClientLimits &limits = ClientLimits(), const QueueConfig &queues = QueueConfig())
+      : NeopixelCommander(ssid, password, brightness, limits, queues) {
+    addStrip(pin, numPixels);
+        }
+
+  // Creates a controller without strips, add them with addStrip().
+  NeopixelCommander(const char *ssid, const char *password, uint16_t brightness,
+                    const ClientLimits &limits = ClientLimits(), const QueueConfig &queues = QueueConfig())
+      : _ssid(ssid), _password(password),
+        _server(80), _ws("/ws"), _stateWs("/ws/state"),
+        _connectTimeoutMs(15000), _brightness(brightness), _clientLimits(limits), _queueConfig(queues) {
         }
 
+  ~NeopixelCommander()
+  {
+    for (uint8_t i = 0; i < _stripCount; ++i)
+      if (_strips[i].ownsOutput)
+        delete _strips[i].output;
+    delete[] _matrixMap;
+    delete[] _transitionFrom;
+    delete[] _transitionTo;
+    for (uint8_t i = 0; i < 3; ++i)
+      delete[] _frameSlots[i].pixels;
+    for (uint8_t i = 0; i < REASSEMBLY_SLOTS; ++i)
+      delete[] _reassembly[i].buffer;
+    free(_payloadBuffer);
+    delete[] _udpBuffer;
+  }
+
+  // Adds a strip on its own pin. Strips share one pixel index space in the
+  // order they were added and can also be addressed individually with the
+  // "strip" field. Give each strip its own asynchronous output (e.g. an
+  // RmtNeopixelOutput per RMT channel) to send all of them in parallel, the
+  // default Adafruit_NeoPixel output sends them one after the other.
+  // Must be called before begin(). Returns the strip number or -1.
+  int addStrip(uint8_t pin, uint16_t numPixels, NeopixelOutput *output = nullptr,
+               neoPixelType type = NEO_GRB + NEO_KHZ800)
+  {
+    if (_stripCount >= MAX_STRIPS || (uint32_t)_numPixels + numPixels > 0xffff)
+      return -1;
+
+    Strip &strip = _strips[_stripCount];
+    strip.pin = pin;
+    strip.offset = _numPixels;
+    strip.numPixels = numPixels;
+    strip.ownsOutput = output == nullptr;
+    strip.output = output ? output : new AdafruitNeopixelOutput(pin, numPixels, type);
+    if (!_setColorOrder(strip, type))
+      _setColorOrder(strip, NEO_GRB);
+
+    _frame.resize(_numPixels + numPixels);
+    _numPixels += numPixels;
+
+    // Reallocated at the new size on the next transition or frame
+    delete[] _transitionFrom;
+    delete[] _transitionTo;
+    _transitionFrom = _transitionTo = nullptr;
+    for (uint8_t i = 0; i < 3; ++i)
+    {
+      delete[] _frameSlots[i].pixels;
+      _frameSlots[i].pixels = nullptr;
+    }
+    return _stripCount++;
+  }
+
+  // Time the station gets to connect before loop() starts a SoftAP instead
   void setConnectTimeout(uint32_t ms) { _connectTimeoutMs = ms; }
 
-  void begin()
+  // Replaces the default Adafruit_NeoPixel output of a strip, e.g. with a
+  // RmtNeopixelOutput for non-blocking show(). The output is started with the
+  // strip's pin and pixel count. Must be called before begin().
+  void setOutput(NeopixelOutput *output, uint8_t strip = 0)
   {
-    Serial.begin(115200);
-    if (DEBUG_LOGGING)
-      Serial.printf("NeopixelWSController starting. Trying STA connect to '%s'\n", _ssid);
+    if (strip >= _stripCount)
+      return;
+    if (_strips[strip].ownsOutput)
+      delete _strips[strip].output;
+    _strips[strip].output = output;
+    _strips[strip].ownsOutput = false;
+  }
 
-    WiFi.mode(WIFI_STA);
-    WiFi.begin(_ssid, _password);
+  // Order the strip expects the colors on the wire in, as an Adafruit
+  // NEO_RGB, NEO_GRB, ... constant. RGBW orders are not supported.
+  bool setColorOrder(neoPixelType order, uint8_t strip = 0)
+  {
+    if (strip >= _stripCount || !_setColorOrder(_strips[strip], order))
+      return false;
+    _frame.markDirty(_strips[strip].offset, _strips[strip].numPixels);
+    return true;
+  }
+
+  // Output correction, applied through per channel lookup tables while the
+  // back buffer is copied to the outputs, so the buffer stays linear.
+  // Gamma uses a fixed 2.6 curve, white balance scales each channel
+  // (255 = unchanged).
+  void setGammaCorrection(bool enabled)
+  {
+    _gammaCorrection = enabled;
+    _invalidateLut();
+  }
+
+  void setWhiteBalance(uint8_t r, uint8_t g, uint8_t b)
+  {
+    _whiteBalance[0] = r;
+    _whiteBalance[1] = g;
+    _whiteBalance[2] = b;
+    _invalidateLut();
+  }
+
+  uint8_t stripCount() const { return _stripCount; }
+  uint16_t stripOffset(uint8_t strip) const { return strip < _stripCount ? _strips[strip].offset : 0; }
+  uint16_t stripLength(uint8_t strip) const { return strip < _stripCount ? _strips[strip].numPixels : 0; }
+
+  // Names a range of the pixel index space, e.g. one shelf or letter. JSON
+  // commands address it with "segment" (name or number) instead of "strip",
+  // indices are then relative to the segment. reverse runs it from the end,
+  // mirror makes it half as long and repeats every write on the other half.
+  // Must be called before begin(). Returns the segment number or -1.
+  int addSegment(const char *name, uint16_t start, uint16_t length, bool reverse = false, bool mirror = false)
+  {
+    if (_segmentCount >= MAX_SEGMENTS || length == 0 || (uint32_t)start + length > _numPixels ||
+        strlen(name) >= SEGMENT_NAME_SIZE)
+      return -1;
+    Segment &segment = _segments[_segmentCount];
+    strcpy(segment.name, name);
+    segment.start = start;
+    segment.length = length;
+    segment.reverse = reverse;
+    segment.mirror = mirror;
+    return _segmentCount++;
+  }
+
+  uint8_t segmentCount() const { return _segmentCount; }
+
+  // Maps x, y onto the pixel index space through a table built once here,
+  // used by matrixIndex() and binary blits. Must be called after the strips
+  // were added and before begin(). Returns false if the matrix does not fit.
+  bool setMatrix(const MatrixLayout &layout)
+  {
+    uint32_t width = (uint32_t)layout.panelWidth * layout.panelsX;
+    uint32_t height = (uint32_t)layout.panelHeight * layout.panelsY;
+    if (width == 0 || height == 0 || width > 0xffff || height > 0xffff ||
+        layout.start + width * height > _numPixels)
+      return false;
 
-    uint32_t start = millis();
-    bool staConnected = false;
+    delete[] _matrixMap;
+    _matrixMap = new uint16_t[width * height];
+    _matrixWidth = width;
+    _matrixHeight = height;
 
-    while (millis() - start < _connectTimeoutMs)
+    uint16_t pw = layout.panelWidth, ph = layout.panelHeight;
+    bool turned = layout.rotation & 1;
+    uint16_t wiredWidth = turned ? ph : pw;
+    for (uint32_t y = 0; y < height; ++y)
     {
-      if (WiFi.status() == WL_CONNECTED)
+      for (uint32_t x = 0; x < width; ++x)
       {
-        staConnected = true;
-        break;
+        uint16_t lx = x % pw, ly = y % ph;
+        uint16_t wx, wy;
+        switch (layout.rotation & 3)
+        {
+        case 1:
+          wx = ly;
+          wy = pw - 1 - lx;
+          break;
+        case 2:
+          wx = pw - 1 - lx;
+          wy = ph - 1 - ly;
+          break;
+        case 3:
+          wx = ph - 1 - ly;
+          wy = lx;
+          break;
+        default:
+          wx = lx;
+          wy = ly;
+          break;
+        }
+        if (layout.serpentine && (wy & 1))
+          wx = wiredWidth - 1 - wx;
+        uint32_t panel = (y / ph) * layout.panelsX + x / pw;
+        _matrixMap[y * width + x] = layout.start + panel * pw * ph + wy * wiredWidth + wx;
       }
-      delay(250);
-      if (DEBUG_LOGGING)
-        Serial.print(".");
     }
+    return true;
+  }
+
+  uint16_t matrixWidth() const { return _matrixWidth; }
+  uint16_t matrixHeight() const { return _matrixHeight; }
+
+  // Pixel index of x, y, or numPixels() outside the matrix
+  uint16_t matrixIndex(uint16_t x, uint16_t y) const
+  {
+    return x < _matrixWidth && y < _matrixHeight ? _matrixMap[y * _matrixWidth + x] : _numPixels;
+  }
+
+  // Drain the command queue in a dedicated FreeRTOS task pinned to
+  // RENDER_TASK_CORE instead of loop(). Every frameIntervalMs the task
+  // executes all pending commands and, if a show was requested since the
+  // last frame, calls show() once. 0 (the default) keeps rendering in loop().
+  // Must be called before begin().
+  void setRenderTask(uint32_t frameIntervalMs) { _frameIntervalMs = frameIntervalMs; }
+
+  // Maximum time loop() spends executing queued commands before returning to
+  // the sketch, checked between commands. 0 drains the whole queue.
+  void setDrainBudget(uint32_t us) { _drainBudgetUs = us; }
+
+  // Additionally stop draining after a show, so every loop() renders at most
+  // one frame and the frames of a burst are spread over several loops.
+  void setDrainUntilShow(bool enabled) { _drainUntilShow = enabled; }
+
+  // Commands executed and time spent by the most recent drain
+  uint16_t lastDrainCount() const { return _lastDrainCount; }
+  uint32_t lastDrainTimeUs() const { return _lastDrainTimeUs; }
+
+  // Time per shown frame since the last resetStats(), including the transfer
+  // for blocking outputs such as the default Adafruit_NeoPixel one
+  uint32_t showTimeAvgUs() const { return _stats.frames ? _stats.showTotalUs / _stats.frames : 0; }
+  uint32_t showTimeMaxUs() const { return _stats.showMaxUs; }
+
+  // Frames shown during the last full second
+  uint16_t framesPerSecond() const
+  {
+    return millis() - _stats.fpsWindowStartMs > 2 * RATE_WINDOW_MS ? 0 : _stats.fps;
+  }
+
+  // Device time that commands with an "at" field are scheduled on. Starts as
+  // millis() until a client sends syncTime or the sketch calls setClock(),
+  // e.g. with the NTP time of day in ms.
+  uint32_t syncedMillis() const
+  {
+    return millis() + _clockOffsetMs.load(std::memory_order_relaxed);
+  }
+
+  void setClock(uint32_t nowMs)
+  {
+    _clockOffsetMs.store(nowMs - millis(), std::memory_order_relaxed);
+  }
+
+  uint16_t scheduledCount() const { return _schedule.size(); }
+
+  // Clears the counters reported by /api/stats and getStats
+  void resetStats()
+  {
+    uint16_t fps = _stats.fps;
+    uint32_t windowStart = _stats.fpsWindowStartMs;
+    _stats = Stats();
+    _stats.fps = fps;
+    _stats.fpsWindowStartMs = windowStart;
+    resetQueueHighWaterMark();
+  }
+
+  // UDP streaming input. Packets are polled from loop() (or the render task)
+  // and written straight into the back buffer, bypassing the command queue,
+  // and are never acked. Can be called before or after begin().
+  //
+  // DDP: the byte offset addresses RGB data over all strips, the push flag
+  // shows the frame.
+  void enableDdp(uint16_t port = DDP_PORT) { _startUdp(_ddp, port); }
+
+  // E1.31 (sACN, unicast) and Art-Net ArtDmx: each universe carries 170 RGB
+  // pixels, startUniverse maps to pixel 0. A frame is shown once all
+  // universes covering the strips arrived, when a universe repeats, or on an
+  // Art-Net ArtSync.
+  void enableE131(uint16_t startUniverse = 1, uint16_t port = E131_PORT)
+  {
+    _e131Universe = startUniverse;
+    _startUdp(_e131, port);
+  }
+
+  void enableArtNet(uint16_t startUniverse = 0, uint16_t port = ARTNET_PORT)
+  {
+    _artNetUniverse = startUniverse;
+    _startUdp(_artNet, port);
+  }
+
+  // How executed commands are acknowledged. ACK_UP_TO assumes every client
+  // uses increasing command IDs.
+  void setAckMode(AckMode mode) { _ackMode = mode; }
+
+  // Lets new commands replace pending ones they supersede: a setPixelColor
+  // the newest pending command if it writes the same pixel, a setBrightness
+  // a pending setBrightness right before it, and a fill of all pixels
+  // (setColor, clear) the pixel writes queued right before it. Nothing is
+  // merged across a show, and only commands of the same client are. Acks
+  // keep the order the commands were sent in. Call before begin().
+  void setCoalescing(bool enabled) { _coalescing = enabled; }
+
+  // Scenes are named copies of the back buffer and the brightness, kept in
+  // NVS across reboots. Names are 1 to 15 printable ASCII characters.
+  // begin() shows the last scene saved or loaded again right after power on. Flash writes
+  // block for a few milliseconds, like the pixel functions these are meant
+  // for the sketch's loop().
+  bool saveScene(const char *name)
+  {
+    size_t len = strlen(name);
+    size_t size = sizeof(SceneHeader) + (size_t)_numPixels * 3;
+    uint8_t *blob = _validSceneName(name, len) ? (uint8_t *)malloc(size) : nullptr;
+    if (blob == nullptr)
+      return false;
+    SceneHeader header = {SCENE_VERSION, _brightness, _numPixels};
+    memcpy(blob, &header, sizeof(header));
+    memcpy(blob + sizeof(header), _frame.data(), (size_t)_numPixels * 3);
 
-    if (staConnected)
+    Preferences prefs;
+    bool ok = _openScenes(prefs, false) && prefs.putBytes(name, blob, size) == size;
+    prefs.end();
+    free(blob);
+    if (ok)
+      _setLastScene(name);
+    return ok;
+  }
+
+  // Writes the scene to the back buffer, it shows on the next show(). A scene
+  // saved with a different pixel count covers the pixels both have.
+  bool loadScene(const char *name)
+  {
+    if (!_validSceneName(name, strlen(name)))
+      return false;
+    Preferences prefs;
+    if (!_openScenes(prefs, true))
+      return false;
+    size_t size = prefs.getBytesLength(name);
+    uint8_t *blob = size >= sizeof(SceneHeader) ? (uint8_t *)malloc(size) : nullptr;
+    bool ok = blob != nullptr && prefs.getBytes(name, blob, size) == size;
+    prefs.end();
+
+    SceneHeader header;
+    if (ok)
     {
-      if (DEBUG_LOGGING)
-        Serial.printf("\nConnected as STA. IP: %s\n", WiFi.localIP().toString().c_str());
+      memcpy(&header, blob, sizeof(header));
+      ok = header.version == SCENE_VERSION && size == sizeof(header) + (size_t)header.numPixels * 3;
     }
-    else
+    if (ok)
     {
-      if (DEBUG_LOGGING)
-        Serial.printf("\nSTA connect failed after %u ms. Starting SoftAP with SSID '%s'\n",
-                      (unsigned)_connectTimeoutMs, _ssid);
+      _frame.write(0, header.numPixels < _numPixels ? header.numPixels : _numPixels, blob + sizeof(header));
+      setBrightness(header.brightness);
+      _setLastScene(name);
+    }
+    free(blob);
+    return ok;
+  }
+
+  bool deleteScene(const char *name)
+  {
+    if (!_validSceneName(name, strlen(name)))
+      return false;
+    Preferences prefs;
+    bool ok = _openScenes(prefs, false) && prefs.remove(name);
+    prefs.end();
+    return ok;
+  }
+
+  // Whether begin() restores the last scene, on by default
+  void setRestoreLastScene(bool enabled) { _restoreLastScene = enabled; }
+
+  bool wifiConnected() const { return WiFi.status() == WL_CONNECTED; }
 
-      if (_password != nullptr && strlen(_password) >= 8)
+  // Lets any number of dashboards watch the strip on ws://<ip>/ws/state
+  // without polling: after every change observers get a text notification
+  // and, with frames, a binary snapshot (BIN_SNAPSHOT) with every downsample
+  // pixels averaged into one. At most one push per intervalMs, encoded once
+  // for all observers. Call before begin().
+  void enableStatePush(uint16_t intervalMs = 100, uint8_t downsample = 1, bool frames = true)
+  {
+    _statePushIntervalMs = intervalMs;
+    _stateDownsample = downsample ? downsample : 1;
+    _stateFrames = frames;
+  }
+
+  void begin()
+  {
+    Serial.begin(115200);
+#if NEOPIXEL_LOG_LEVEL > NEOPIXEL_LOG_LEVEL_NONE
+    NeopixelLog::instance().begin();
+#endif
+
+    _allocateQueues();
+
+    // The strips come up with the last scene before WiFi is even started
+    for (uint8_t i = 0; i < _stripCount; ++i)
+    {
+      Strip &strip = _strips[i];
+      if (!strip.output->begin(strip.pin, strip.numPixels) && !strip.ownsOutput)
       {
-        WiFi.mode(WIFI_AP_STA);
-        bool ok = WiFi.softAP(_ssid, _password);
-        if (!ok)
-        {
-          if (DEBUG_LOGGING)
-            Serial.println("softAP() returned false. Attempting open AP (no password).");
-          WiFi.softAP(_ssid);
-        }
+        NEOPIXEL_LOG_WARN("Failed to start output of strip %u, falling back to Adafruit_NeoPixel.\n", i);
+        strip.output = new AdafruitNeopixelOutput(strip.pin, strip.numPixels);
+        strip.ownsOutput = true;
+        strip.output->begin(strip.pin, strip.numPixels);
+      }
+    }
+    if (_restoreLastScene)
+      _loadLastScene();
+    _present();
+
+    // Connects in the background, loop() falls back to a SoftAP on timeout
+    NEOPIXEL_LOG_INFO("NeopixelWSController starting. Trying STA connect to '%s'\n", _ssid);
+    WiFi.mode(WIFI_STA);
+    WiFi.begin(_ssid, _password);
+    _wifiState = WIFI_STATE_CONNECTING;
+    _wifiStartMs = millis();
+
+    if (_frameIntervalMs > 0)
+    {
+      BaseType_t ok = xTaskCreatePinnedToCore(_renderTaskEntry, "neopixelRender", RENDER_TASK_STACK_SIZE,
+                                              this, RENDER_TASK_PRIORITY, &_renderTask, RENDER_TASK_CORE);
+      if (ok != pdPASS)
+      {
+        _renderTask = nullptr;
+        NEOPIXEL_LOG_WARN("Failed to start render task, rendering in loop() instead.\n");
       }
       else
       {
-        if (DEBUG_LOGGING)
-          Serial.println("Password too short for WPA2; starting open AP.");
-        WiFi.mode(WIFI_AP);
-        WiFi.softAP(_ssid);
+        NEOPIXEL_LOG_INFO("Render task running on core %d every %u ms\n", RENDER_TASK_CORE, (unsigned)_frameIntervalMs);
       }
-
-      delay(500);
-      if (DEBUG_LOGGING)
-        Serial.printf("SoftAP active. AP IP: %s\n", WiFi.softAPIP().toString().c_str());
     }
 
-    _strip.begin();
-    _strip.show();
+    // Allocated once up front, messages never allocate
+    for (uint8_t i = 0; i < REASSEMBLY_SLOTS; ++i)
+      if (_reassembly[i].buffer == nullptr)
+        _reassembly[i].buffer = new uint8_t[REASSEMBLY_BUFFER_SIZE];
 
     _ws.onEvent([this](AsyncWebSocket *server, AsyncWebSocketClient *client,
                        AwsEventType type, void *arg, uint8_t *data, size_t len)
@@ -110,22 +923,40 @@ public:
 
     _server.addHandler(&_ws);
 
+    if (_statePushIntervalMs > 0)
+    {
+      // A new observer gets the current state with the next push
+      _stateWs.onEvent([this](AsyncWebSocket *, AsyncWebSocketClient *, AwsEventType type, void *, uint8_t *,
+                              size_t)
+                       {
+        if (type == WS_EVT_CONNECT)
+          _statePending.store(true, std::memory_order_relaxed); });
+      _server.addHandler(&_stateWs);
+    }
+
+    // HTTP stats endpoint
+    _server.on("/api/stats", HTTP_GET, [this](AsyncWebServerRequest *request)
+               {
+      char response[STATS_BUFFER_SIZE];
+      _formatStats(response, sizeof(response));
+      request->send(200, "application/json", response); });
+
     // HTTP Pixel count endpoint
     _server.on("/api/pixelCount", HTTP_GET, [this](AsyncWebServerRequest *request)
                {
-      char response[64];
-      snprintf(response, sizeof(response), "{\"status\":\"ok\",\"pixelCount\":%u}", _numPixels);
+      char response[96 + MAX_STRIPS * 6];
+      _formatPixelCount(response, sizeof(response));
       request->send(200, "application/json", response); });
 
     // HTTP Ping endpoint
     _server.on("/ping", HTTP_GET, [this](AsyncWebServerRequest *request)
                {
-      if (DEBUG_LOGGING) Serial.println("Received HTTP ping (GET)");
+      NEOPIXEL_LOG_DEBUG("Received HTTP ping (GET)\n");
       request->send(200, "application/json", "{\"status\":\"ok\",\"message\":\"pong\"}"); });
 
     _server.on("/ping", HTTP_POST, [this](AsyncWebServerRequest *request)
                {
-      if (DEBUG_LOGGING) Serial.println("Received HTTP ping (POST)");
+      NEOPIXEL_LOG_DEBUG("Received HTTP ping (POST)\n");
       request->send(200, "application/json", "{\"status\":\"ok\",\"message\":\"pong\"}"); });
 
     _server.on("/api/setColor", HTTP_POST, [this](AsyncWebServerRequest *request)
@@ -134,285 +965,2928 @@ public:
           int r = request->getParam("r", true)->value().toInt();
           int g = request->getParam("g", true)->value().toInt();
           int b = request->getParam("b", true)->value().toInt();
-          this->setColor(r,g,b);
-          request->send(200, "application/json", "{\"status\":\"ok\"}");
+          Command command = {};
+          command.type = SET_COLOR;
+          command.count = _numPixels;
+          command.r = r;
+          command.g = g;
+          command.b = b;
+          _enqueueFromHttp(request, command);
       } else {
           request->send(400, "application/json", "{\"status\":\"error\",\"error\":\"missing_params\"}");
       } });
 
     _server.on("/api/clear", HTTP_POST, [this](AsyncWebServerRequest *request)
                {
-      _strip.clear();
-      request->send(200, "application/json", "{\"status\":\"ok\"}"); });
+      Command command = {};
+      command.type = CLEAR;
+      command.count = _numPixels;
+      _enqueueFromHttp(request, command); });
 
     _server.on("/api/clear", HTTP_GET, [this](AsyncWebServerRequest *request)
                {
-      _strip.clear();
-      request->send(200, "application/json", "{\"status\":\"ok\"}"); });
+      Command command = {};
+      command.type = CLEAR;
+      command.count = _numPixels;
+      _enqueueFromHttp(request, command); });
 
     _server.on("/api/setBrightness", HTTP_POST, [this](AsyncWebServerRequest *request)
                {
       if (request->hasParam("brightness", true)) {
           int b = request->getParam("brightness", true)->value().toInt();
-          _strip.setBrightness(b);
-          request->send(200, "application/json", "{\"status\":\"ok\"}");
+          Command command = {};
+          command.type = SET_BRIGHTNESS;
+          command.brightness = b;
+          _enqueueFromHttp(request, command);
       } else {
           request->send(400, "application/json", "{\"status\":\"error\",\"error\":\"missing_param\"}");
       } });
 
     _server.on("/api/show", HTTP_POST, [this](AsyncWebServerRequest *request)
                {
-                 this->show();
-                 request->send(200, "application/json", "{\"status\":\"ok\"}"); });
+                 Command command = {};
+                 command.type = SHOW;
+                 _enqueueFromHttp(request, command); });
     _server.on("/api/show", HTTP_GET, [this](AsyncWebServerRequest *request)
                {
-                 this->show();
-                 request->send(200, "application/json", "{\"status\":\"ok\"}"); });
+                 Command command = {};
+                 command.type = SHOW;
+                 _enqueueFromHttp(request, command); });
 
     _server.begin();
 
-    IPAddress ip = (WiFi.getMode() & WIFI_AP) ? WiFi.softAPIP() : WiFi.localIP();
-    if (DEBUG_LOGGING)
-      Serial.printf("WebSocket endpoint: ws://%s/ws\n", ip.toString().c_str());
-    if (DEBUG_LOGGING)
-      Serial.printf("HTTP ping endpoint: http://%s/ping\n", ip.toString().c_str());
+    for (UdpInput *input : {&_ddp, &_e131, &_artNet})
+      if (input->port != 0)
+        _startUdp(*input, input->port);
   }
 
   void loop()
   {
+    _updateWifi();
     _ws.cleanupClients();
+    _stateWs.cleanupClients();
 
-    // Process multiple commands per loop to keep up with incoming rate
-    int processed = 0;
-    while (queueStart != queueEnd && processed < COMMANDS_PER_LOOP)
+    // With a render task the queue is drained there instead
+    if (_renderTask == nullptr)
     {
-      Command cmd = commandQueue[queueStart];
-      queueStart = (queueStart + 1) % QUEUE_SIZE;
-
-      // Execute the command
-      switch (cmd.type)
-      {
-      case SET_PIXEL_COLOR:
-        _strip.setPixelColor(cmd.index, cmd.r, cmd.g, cmd.b);
-        break;
-      case SET_COLOR:
-        for (uint16_t i = 0; i < _numPixels; ++i)
-          _strip.setPixelColor(i, _strip.Color(cmd.r, cmd.g, cmd.b));
-        break;
-      case CLEAR:
-        _strip.clear();
-        break;
-      case SHOW:
-        _strip.show();
-        break;
-      case SET_BRIGHTNESS:
-        _strip.setBrightness(cmd.brightness);
-        break;
-      }
+      _pollUdp();
+      _processCommands(queueCapacity(), _drainBudgetUs, _drainUntilShow);
 
-      // Send acknowledgment AFTER the command is executed
-      AsyncWebSocketClient *client = _ws.client(cmd.clientId);
-      if (client && client->status() == WS_CONNECTED)
+      if (_animating() && millis() - _lastAnimationFrameMs >= EFFECT_FRAME_INTERVAL_MS)
       {
-        char ackMsg[64];
-        snprintf(ackMsg, sizeof(ackMsg), "{\"status\":\"ok\",\"ack\":%u}", cmd.commandId);
-        client->text(ackMsg);
+        _lastAnimationFrameMs = millis();
+        _renderAnimations();
+        _present();
       }
-
-      processed++;
+      _pushState();
     }
   }
 
+  // The pixel functions below write into the back buffer, which only reaches
+  // the LEDs on show(). They are meant to be called from the sketch's loop()
+  // and must not be mixed with a render task.
   void setColor(uint8_t r, uint8_t g, uint8_t b)
   {
-    for (uint16_t i = 0; i < _numPixels; ++i)
-      _strip.setPixelColor(i, _strip.Color(r, g, b));
+    _frame.fill(0, _numPixels, r, g, b);
   }
 
   void setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b)
   {
     if (n < _numPixels)
     {
-      _strip.setPixelColor(n, _strip.Color(r, g, b));
+      _frame.set(n, r, g, b);
     }
   }
 
   void clear()
   {
-    _strip.clear();
+    _frame.clear(0, _numPixels);
   }
 
+  // Sends the back buffer, skipped if nothing changed since the last show
   void show()
   {
-    _strip.show();
+    _present();
+  }
+
+  // Makes the next show send all pixels, e.g. after the strips lost power
+  void invalidate()
+  {
+    _frame.markDirty(0, _numPixels);
   }
 
+  bool hasRenderTask() const { return _renderTask != nullptr; }
+
   void setBrightness(uint8_t brightness)
   {
-    _strip.setBrightness(brightness);
+    if (brightness != _brightness)
+      _invalidateLut();
+    _brightness = brightness;
   }
 
-private:
-  static const uint16_t QUEUE_SIZE = 512;
+  // Rate limit for each WebSocket client, messages over it are answered with
+  // rate_limited without being parsed. Takes effect for new connections.
+  void setClientLimits(const ClientLimits &limits) { _clientLimits = limits; }
 
-  const char *_ssid;
+  // Number of commands currently waiting to be executed by loop(), over the
+  // shared queue and all client queues.
+  uint16_t queueDepth() const
+  {
+    uint16_t depth = _commandQueue.depth();
+    for (uint8_t i = 0; i < CLIENT_QUEUES; ++i)
+      depth += _clientQueues[i].queue.depth();
+    return depth;
+  }
+
+  // Highest depth seen by any of the queues since start or the last reset.
+  uint16_t queueHighWaterMark() const
+  {
+    uint16_t mark = _commandQueue.highWaterMark();
+    for (uint8_t i = 0; i < CLIENT_QUEUES; ++i)
+      if (_clientQueues[i].queue.highWaterMark() > mark)
+        mark = _clientQueues[i].queue.highWaterMark();
+    return mark;
+  }
+
+  void resetQueueHighWaterMark()
+  {
+    _commandQueue.resetHighWaterMark();
+    for (uint8_t i = 0; i < CLIENT_QUEUES; ++i)
+      _clientQueues[i].queue.resetHighWaterMark();
+  }
+
+  uint32_t queueCapacity() const
+  {
+    uint32_t capacity = _commandQueue.capacity();
+    for (uint8_t i = 0; i < CLIENT_QUEUES; ++i)
+      capacity += _clientQueues[i].queue.capacity();
+    return capacity;
+  }
+
+  // Memory used by the controller, also reported by /api/stats
+  size_t objectBytes() const { return sizeof(*this); }
+  size_t queueBytes() const // queues and payload buffer
+  {
+    size_t bytes = _commandQueue.bytes() + _payloadCapacity;
+    for (uint8_t i = 0; i < CLIENT_QUEUES; ++i)
+      bytes += _clientQueues[i].queue.bytes();
+    return bytes;
+  }
+  size_t frameBytes() const
+  {
+    return (size_t)_numPixels * 3 * (1 + (_transitionFrom ? 2 : 0) + (_frameSlots[0].pixels ? 3 : 0)) +
+           (size_t)_matrixWidth * _matrixHeight * sizeof(uint16_t);
+  }
+
+private:
+  struct Strip
+  {
+    uint8_t pin;
+    uint16_t offset; // index of the strip's first pixel in the back buffer
+    uint16_t numPixels;
+    NeopixelOutput *output;
+    bool ownsOutput;
+    uint8_t rgbOffsets[3]; // wire position of red, green and blue
+  };
+
+  const char *_ssid;
   const char *_password;
-  uint8_t _pin;
-  uint16_t _numPixels;
+  uint16_t _numPixels = 0; // total over all strips
+
+  Strip _strips[MAX_STRIPS];
+  uint8_t _stripCount = 0;
+
+  struct Segment
+  {
+    char name[SEGMENT_NAME_SIZE];
+    uint16_t start; // in the back buffer
+    uint16_t length;
+    bool reverse;
+    bool mirror;
+  };
+
+  static_assert(MAX_SEGMENTS <= 15, "segment numbers must fit CMD_SEGMENT_MASK");
+  Segment _segments[MAX_SEGMENTS];
+  uint8_t _segmentCount = 0;
+
+  uint16_t *_matrixMap = nullptr; // pixel index per cell, row by row
+  uint16_t _matrixWidth = 0;
+  uint16_t _matrixHeight = 0;
 
   AsyncWebServer _server;
   AsyncWebSocket _ws;
-  Adafruit_NeoPixel _strip;
+  AsyncWebSocket _stateWs; // observers, see enableStatePush()
 
   uint32_t _connectTimeoutMs;
 
-  Command commandQueue[QUEUE_SIZE];
-  uint16_t queueStart = 0;
-  uint16_t queueEnd = 0;
+  // State push to /ws/state, see enableStatePush()
+  uint16_t _statePushIntervalMs = 0;
+  uint8_t _stateDownsample = 1;
+  bool _stateFrames = true;
+  std::atomic<bool> _statePending{false}; // something was shown or an observer joined
+  uint32_t _lastStatePushMs = 0;
+  uint32_t _shownFrames = 0; // numbers the snapshots, not reset with the stats
+
+  enum WifiState : uint8_t
+  {
+    WIFI_STATE_CONNECTING,
+    WIFI_STATE_CONNECTED,
+    WIFI_STATE_SOFTAP
+  };
+  WifiState _wifiState = WIFI_STATE_CONNECTING; // loop() only
+  uint32_t _wifiStartMs = 0;
+
+  // Scenes are NVS blobs named after the scene: a SceneHeader and the GRB
+  // pixels. NVS keys are at most 15 characters.
+  static const uint8_t SCENE_NAME_SIZE = 16;
+  static const uint8_t SCENE_VERSION = 1;
+  struct SceneHeader
+  {
+    uint8_t version;
+    uint8_t brightness;
+    uint16_t numPixels;
+  };
+  bool _restoreLastScene = true;
+  bool _commandFailed = false; // set by _execute(), the command is not acked
+
+  // Back buffer, _present() copies it to the outputs in one pass
+  PixelBuffer _frame;
+
+  // Rebuilt by _present() after a change
+  ColorLut _lut;
+  bool _lutValid = false;
+  bool _gammaCorrection = false;
+  uint8_t _whiteBalance[3] = {255, 255, 255};
+  uint8_t _brightness;
+
+  struct PendingAcks
+  {
+    uint32_t clientId;
+    uint16_t count;
+    uint32_t ids[ACK_BATCH_SIZE];
+  };
+
+  AckMode _ackMode = ACK_EACH;
+
+  bool _coalescing = false;
+  portMUX_TYPE _coalesceLock = portMUX_INITIALIZER_UNLOCKED; // producer rewrites vs. pop()
+
+  // Acks of commands the producer replaced or dropped. loop() sends them
+  // before any later ack, so they never follow the command replacing them.
+  // Written under _coalesceLock.
+  struct DeferredAck
+  {
+    uint32_t clientId;
+    uint32_t commandId;
+  };
+  static const uint8_t DEFERRED_ACKS = 2 * COALESCE_WINDOW;
+  DeferredAck _deferredAcks[DEFERRED_ACKS];
+  std::atomic<uint8_t> _deferredAckCount{0};
+  PendingAcks _pendingAcks[ACK_BATCH_CLIENTS];
+  uint8_t _pendingAckClients = 0;
+
+  static const uint32_t RATE_WINDOW_MS = 1000;
+  static const size_t STATS_BUFFER_SIZE = 768 + STATS_MAX_CLIENTS * 48;
+
+  // Plain counters, each one is only written by a single task: parse and
+  // queue counters by the AsyncTCP task, frame counters by loop() or the
+  // render task. Readers may see slightly stale values.
+  struct Stats
+  {
+    uint32_t queueFull = 0;
+    uint32_t badJson = 0;
+    uint32_t parseCount = 0;
+    uint32_t parseTotalUs = 0;
+    uint32_t parseMaxUs = 0;
+
+    uint32_t reassemblyBusy = 0;
+    uint32_t rateLimited = 0;
+    uint32_t coalesced = 0;
+    uint32_t framesDropped = 0;
+    uint32_t udpPackets = 0;
+    uint32_t badUdp = 0;
+
+    uint32_t frames = 0;
+    uint32_t showsSkipped = 0;
+    uint32_t statePushes = 0;
+    uint32_t statePushesSkipped = 0;
+    uint32_t showTotalUs = 0;
+    uint32_t showMaxUs = 0;
+    uint16_t fps = 0;
+    uint16_t fpsWindowFrames = 0;
+    uint32_t fpsWindowStartMs = 0;
+  };
+
+  struct ClientStats
+  {
+    uint32_t clientId;
+    uint32_t messages;
+    uint32_t windowStartMs;
+    uint16_t windowMessages;
+    uint16_t rate; // messages during the last full second
+  };
+
+  struct Reassembly
+  {
+    uint32_t clientId; // 0 while the slot is free
+    uint8_t opcode;
+    bool overflow;
+    size_t size;
+    uint8_t *buffer;
+  };
+
+  Reassembly _reassembly[REASSEMBLY_SLOTS] = {};
+
+  Stats _stats;
+  ClientStats _clientStats[STATS_MAX_CLIENTS] = {};
+
+  uint32_t _drainBudgetUs = DRAIN_BUDGET_US;
+  bool _drainUntilShow = false;
+  uint16_t _lastDrainCount = 0;
+  uint32_t _lastDrainTimeUs = 0;
+
+  struct UdpInput
+  {
+    WiFiUDP socket;
+    uint16_t port = 0;
+    bool running = false;
+  };
+
+  UdpInput _ddp;
+  UdpInput _e131;
+  UdpInput _artNet;
+  uint16_t _e131Universe = 1;
+  uint16_t _artNetUniverse = 0;
+  uint8_t *_udpBuffer = nullptr; // UDP_BUFFER_SIZE bytes, allocated with the first UDP input
+  // One bit per universe covering the strips, see _onDmxUniverse()
+  uint32_t _universesReceived[(0xffff / DMX_PIXELS_PER_UNIVERSE + 32) / 32] = {};
+
+  // Parameters of a running effect, also the START_EFFECT payload
+  struct Effect
+  {
+    EffectType type;
+    uint16_t start;
+    uint16_t count;
+    uint16_t period; // ms per cycle
+    uint8_t size;
+    bool reverse;
+    uint8_t segment; // segment + 1 to render through, 0 for the plain range
+    uint8_t paletteSize;
+    uint32_t palette[MAX_PALETTE_SIZE]; // 0xRRGGBB
+    uint32_t startedMs;
+  };
+
+  // Only touched by the task executing commands
+  Effect _effects[MAX_EFFECTS] = {};
+  uint8_t _activeEffects = 0;
+
+  // A running fadeTo, the colors live in _transitionFrom/_transitionTo at the
+  // same offsets as in _frame. count 0 marks a free slot.
+  struct Transition
+  {
+    uint16_t start;
+    uint16_t count;
+    uint16_t durationMs;
+    uint32_t startedMs;
+  };
+
+  Transition _transitions[MAX_TRANSITIONS] = {};
+  uint8_t _activeTransitions = 0;
+  uint8_t *_transitionFrom = nullptr; // allocated on the first transition
+  uint8_t *_transitionTo = nullptr;
+  uint32_t _lastAnimationFrameMs = 0;
+
+  uint32_t _frameIntervalMs = 0;
+  TaskHandle_t _renderTask = nullptr;
+  std::atomic<bool> _showRequested{false};
+
+  SpscQueue<Command> _commandQueue;
+
+  struct TokenBucket
+  {
+    uint32_t tokens = 0; // in 1/1000 messages
+    uint32_t refilledMs = 0;
+  };
+
+  // Sub-queue of one WebSocket client. clientId and the bucket are only
+  // used by the AsyncTCP task, a freed slot keeps draining its queue.
+  struct ClientQueue
+  {
+    uint32_t clientId = 0;
+    TokenBucket bucket;
+    SpscQueue<Command> queue;
+  };
+
+  ClientQueue _clientQueues[CLIENT_QUEUES];
+  TokenBucket _sharedBucket; // clients without a queue of their own
+  ClientLimits _clientLimits;
+  QueueConfig _queueConfig;
+  uint8_t _nextQueue = 0;    // round robin position of loop(), CLIENT_QUEUES is the shared queue
+
+  // Pixel data of queued SET_PIXELS commands, _payloadCapacity bytes
+  // allocated by begin(). Written by the WebSocket handler at _payloadHead.
+  // The command queue's release/acquire pair publishes the bytes to loop(),
+  // _payloadTail publishes freed space back to the producer.
+  uint8_t *_payloadBuffer = nullptr;
+  uint16_t _payloadCapacity = 0;
+  std::atomic<uint16_t> _payloadHead{0};
+  std::atomic<uint16_t> _payloadTail{0};
+
+  // Payloads are consumed out of order (round robin, scheduled commands), so
+  // the end of each one is recorded in the order they were written. loop()
+  // marks them done and moves _payloadTail over the finished ones.
+  static const uint16_t PAYLOAD_RECORDS = 256;
+  uint16_t _payloadEnds[PAYLOAD_RECORDS];
+  bool _payloadDone[PAYLOAD_RECORDS] = {}; // loop() only
+  std::atomic<uint16_t> _payloadRecordHead{0};
+  std::atomic<uint16_t> _payloadRecordTail{0};
+
+  // Latest frame wins: setFrame decodes into the write slot and swaps it
+  // with the ready one, loop() swaps the ready one with its read slot. A
+  // ready frame that is replaced before loop() took it is dropped.
+  struct FrameSlot
+  {
+    uint8_t *pixels;
+    Command command; // for the ack
+  };
+
+  static const uint8_t FRAME_FRESH = 0x80;
+  FrameSlot _frameSlots[3] = {};
+  std::atomic<uint8_t> _readyFrame{1}; // slot index, FRAME_FRESH if loop() has not taken it
+  uint8_t _writeFrame = 0;             // AsyncTCP task only
+
+  uint8_t _palette[256 * 3] = {}; // BIN_SET_INDEXED colors, AsyncTCP task only
+  uint8_t _readFrame = 2;              // loop() only
+
+  ScheduleQueue<Command, SCHEDULE_SIZE> _schedule; // loop() only
+  std::atomic<uint32_t> _clockOffsetMs{0};
+
+  // SHOW commands show right away when rendering in loop(). The render task
+  // collects them and shows once at the end of the frame instead.
+  void _requestShow()
+  {
+    if (_renderTask == nullptr)
+      _present();
+    else
+      _showRequested.store(true, std::memory_order_relaxed);
+  }
+
+  static void _renderTaskEntry(void *arg)
+  {
+    static_cast<NeopixelCommander *>(arg)->_renderLoop();
+  }
+
+  void _renderLoop()
+  {
+    TickType_t lastWake = xTaskGetTickCount();
+    TickType_t interval = pdMS_TO_TICKS(_frameIntervalMs);
+    if (interval == 0)
+      interval = 1;
+
+    for (;;)
+    {
+      vTaskDelayUntil(&lastWake, interval);
+
+      // Everything received until now belongs to this frame
+      _pollUdp();
+      _processCommands(queueDepth(), 0, false);
+
+      // Effects and transitions render at the task's frame rate
+      bool animating = _animating();
+      if (animating)
+        _renderAnimations();
+
+      if (_showRequested.exchange(false, std::memory_order_relaxed) || animating)
+        _present();
+      _pushState();
+    }
+  }
+
+  void _processCommands(int maxCommands, uint32_t budgetUs, bool untilShow)
+  {
+    // Process as many commands as fit into the budget to keep up with bursts
+    uint32_t start = micros();
+    int processed = 0;
+    bool shown = false;
+    Command cmd;
+
+    // Scheduled commands that became due go first
+    uint32_t now = syncedMillis();
+    while (!shown && _schedule.popDue(now, cmd))
+    {
+      shown = _execute(cmd) && untilShow;
+      _releasePayload(cmd);
+      _acknowledge(cmd);
+      processed++;
+    }
+
+    while (processed < maxCommands && !shown &&
+           (budgetUs == 0 || micros() - start < budgetUs) && _popCommand(cmd))
+    {
+      if (cmd.at != 0 && (int32_t)(cmd.at - now) > 0)
+      {
+        // Keeps its payload until it runs
+        if (!_schedule.push(cmd))
+        {
+          _sendError(cmd.clientId, "schedule_full", cmd.commandId);
+          _releasePayload(cmd);
+        }
+        processed++;
+        continue;
+      }
+
+      shown = _execute(cmd) && untilShow;
+      _releasePayload(cmd);
+      _acknowledge(cmd);
+      processed++;
+    }
+
+    _applyFrame();
+
+    // Picks up payloads that were released before their record was published
+    _advancePayloadTail();
+    _sendDeferredAcks();
+    _flushPendingAcks();
+
+    _lastDrainCount = processed;
+    _lastDrainTimeUs = micros() - start;
+  }
+
+  // Takes the next command round robin over the shared and the client queues
+  bool _popCommand(Command &cmd)
+  {
+    for (uint8_t n = 0; n <= CLIENT_QUEUES; ++n)
+    {
+      uint8_t q = _nextQueue;
+      _nextQueue = q == CLIENT_QUEUES ? 0 : q + 1;
+      if (_coalescing)
+        portENTER_CRITICAL(&_coalesceLock);
+      bool popped = q == CLIENT_QUEUES ? _commandQueue.pop(cmd) : _clientQueues[q].queue.pop(cmd);
+      if (_coalescing)
+        portEXIT_CRITICAL(&_coalesceLock);
+      if (popped)
+        return true;
+    }
+    return false;
+  }
+
+  // Executes a command, returns true if it requested a show
+  bool _execute(const Command &cmd)
+  {
+    switch (cmd.type)
+    {
+    case SET_PIXEL_COLOR:
+      setPixelColor(cmd.index, cmd.r, cmd.g, cmd.b);
+      if (cmd.flags & CMD_SEGMENT_MASK)
+        _mirrorWrite(cmd);
+      break;
+    case SET_COLOR:
+      _frame.fill(cmd.index, cmd.count, cmd.r, cmd.g, cmd.b);
+      if (cmd.flags & CMD_SEGMENT_MASK)
+        _mirrorWrite(cmd);
+      break;
+    case CLEAR:
+      _frame.clear(cmd.index, cmd.count);
+      break;
+    case SHOW:
+      _requestShow();
+      return true;
+    case SET_BRIGHTNESS:
+      setBrightness(cmd.brightness);
+      break;
+    case SET_PIXELS:
+      _frame.write(cmd.index, cmd.count, _payloadBuffer + cmd.payload);
+      if (cmd.flags & CMD_SEGMENT_MASK)
+        _mirrorWrite(cmd);
+      if (cmd.flags & BIN_FLAG_SHOW)
+      {
+        _requestShow();
+        return true;
+      }
+      break;
+    case START_EFFECT:
+    {
+      Effect effect;
+      memcpy(&effect, _payloadBuffer + cmd.payload, sizeof(Effect));
+      if (!_startEffect(effect))
+      {
+        _sendError(cmd.clientId, "effects_full", cmd.commandId);
+        _commandFailed = true;
+      }
+      break;
+    }
+    case STOP_EFFECT:
+      _stopEffects(cmd.index, cmd.count);
+      break;
+    case FADE_TO:
+      _startTransition(cmd.index, cmd.count, nullptr, cmd.r, cmd.g, cmd.b, cmd.duration);
+      break;
+    case FADE_TO_PIXELS:
+      _startTransition(cmd.index, cmd.count, _payloadBuffer + cmd.payload, 0, 0, 0, cmd.duration);
+      break;
+    case XOR_PIXELS:
+      _frame.applyXor(cmd.index, cmd.count, _payloadBuffer + cmd.payload);
+      if (cmd.flags & BIN_FLAG_SHOW)
+      {
+        _requestShow();
+        return true;
+      }
+      break;
+    case BLIT:
+      _blit(cmd.index, cmd.duration, cmd.count / cmd.duration, _payloadBuffer + cmd.payload);
+      if (cmd.flags & BIN_FLAG_SHOW)
+      {
+        _requestShow();
+        return true;
+      }
+      break;
+    case SAVE_SCENE:
+    case LOAD_SCENE:
+    case DELETE_SCENE:
+      return _executeScene(cmd);
+    case ACK_ONLY:
+      break;
+    }
+    return false;
+  }
+
+  // Send acknowledgment AFTER the command is executed
+  void _acknowledge(const Command &cmd)
+  {
+    _sendDeferredAcks();
+    if (_commandFailed)
+    {
+      _commandFailed = false;
+      return;
+    }
+    if (cmd.clientId != 0 && !(cmd.flags & BIN_FLAG_NO_ACK))
+    {
+      if (_ackMode == ACK_EACH)
+        _sendAck(cmd.clientId, cmd.commandId);
+      else
+        _addPendingAck(cmd.clientId, cmd.commandId);
+    }
+  }
+
+  // Consumer side of _deferAck()
+  void _sendDeferredAcks()
+  {
+    if (_deferredAckCount.load(std::memory_order_acquire) == 0)
+      return;
+    DeferredAck acks[DEFERRED_ACKS];
+    portENTER_CRITICAL(&_coalesceLock);
+    uint8_t count = _deferredAckCount.load(std::memory_order_relaxed);
+    memcpy(acks, _deferredAcks, count * sizeof(DeferredAck));
+    _deferredAckCount.store(0, std::memory_order_relaxed);
+    portEXIT_CRITICAL(&_coalesceLock);
+
+    for (uint8_t i = 0; i < count; ++i)
+    {
+      if (_ackMode == ACK_EACH)
+        _sendAck(acks[i].clientId, acks[i].commandId);
+      else
+        _addPendingAck(acks[i].clientId, acks[i].commandId);
+    }
+  }
+
+  void _sendAck(uint32_t clientId, uint32_t commandId)
+  {
+    AsyncWebSocketClient *client = _ws.client(clientId);
+    if (client && client->status() == WS_CONNECTED)
+    {
+      char ackMsg[64];
+      snprintf(ackMsg, sizeof(ackMsg), "{\"status\":\"ok\",\"ack\":%u}", commandId);
+      client->text(ackMsg);
+    }
+  }
+
+  void _addPendingAck(uint32_t clientId, uint32_t commandId)
+  {
+    PendingAcks *entry = nullptr;
+    for (uint8_t i = 0; i < _pendingAckClients; ++i)
+      if (_pendingAcks[i].clientId == clientId)
+        entry = &_pendingAcks[i];
+
+    if (entry == nullptr)
+    {
+      if (_pendingAckClients == ACK_BATCH_CLIENTS)
+        _flushPendingAcks();
+      entry = &_pendingAcks[_pendingAckClients++];
+      entry->clientId = clientId;
+      entry->count = 0;
+    }
+    else if (_ackMode == ACK_BATCH && entry->count == ACK_BATCH_SIZE)
+    {
+      _sendPendingAcks(*entry);
+      entry->count = 0;
+    }
+
+    if (_ackMode == ACK_UP_TO)
+    {
+      // A frame is acked after the commands drained in its pass, which may
+      // have higher ids, so the reported id must not go backwards
+      if (entry->count == 0 || (int32_t)(commandId - entry->ids[0]) > 0)
+        entry->ids[0] = commandId;
+      entry->count = 1;
+    }
+    else
+    {
+      entry->ids[entry->count++] = commandId;
+    }
+  }
+
+  void _sendPendingAcks(const PendingAcks &entry)
+  {
+    AsyncWebSocketClient *client = _ws.client(entry.clientId);
+    if (!client || client->status() != WS_CONNECTED || entry.count == 0)
+      return;
+
+    char ackMsg[40 + ACK_BATCH_SIZE * 11];
+    if (_ackMode == ACK_UP_TO)
+    {
+      snprintf(ackMsg, sizeof(ackMsg), "{\"status\":\"ok\",\"ackUpTo\":%u}", entry.ids[0]);
+    }
+    else
+    {
+      int len = snprintf(ackMsg, sizeof(ackMsg), "{\"status\":\"ok\",\"acks\":[");
+      for (uint16_t i = 0; i < entry.count; ++i)
+        len += snprintf(ackMsg + len, sizeof(ackMsg) - len, i ? ",%u" : "%u", entry.ids[i]);
+      snprintf(ackMsg + len, sizeof(ackMsg) - len, "]}");
+    }
+    client->text(ackMsg);
+  }
+
+  void _flushPendingAcks()
+  {
+    for (uint8_t i = 0; i < _pendingAckClients; ++i)
+      _sendPendingAcks(_pendingAcks[i]);
+    _pendingAckClients = 0;
+  }
 
   bool enqueueCommand(const Command &cmd)
   {
-    uint16_t nextEnd = (queueEnd + 1) % QUEUE_SIZE;
-    if (nextEnd == queueStart)
+    ClientQueue *slot = _findClientQueue(cmd.clientId);
+    if (!(slot ? _push(slot->queue, cmd) : _push(_commandQueue, cmd)))
     {
-      if (DEBUG_LOGGING)
-        Serial.printf("WARNING: Command queue full! Dropping command ID %u\n", cmd.commandId);
+      _stats.queueFull++;
+      NEOPIXEL_LOG_WARN("Command queue full! Dropping command ID %u\n", cmd.commandId);
       return false;
     }
-    commandQueue[queueEnd] = cmd;
-    queueEnd = nextEnd;
     return true;
   }
 
-  inline void _onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client,
-                         AwsEventType type, void *arg, uint8_t *data, size_t len)
+  // Finds a contiguous region of `size` bytes in the payload buffer. The
+  // region is only claimed once _commitPayload() is called.
+  bool _reservePayload(uint16_t size, uint16_t &offset)
   {
-    if (type == WS_EVT_CONNECT)
+    uint16_t head = _payloadHead.load(std::memory_order_relaxed);
+    uint16_t tail = _payloadTail.load(std::memory_order_acquire);
+    if (head >= tail)
     {
-      if (DEBUG_LOGGING)
-        Serial.printf("WebSocket client #%u connected\n", client->id());
+      // Free space is [head, _payloadCapacity) plus [0, tail). Filling up to
+      // the very end is only allowed if the head can wrap without meeting the
+      // tail.
+      if (head + size < _payloadCapacity || (head + size == _payloadCapacity && tail > 0))
+      {
+        offset = head;
+        return true;
+      }
+      if (size < tail)
+      {
+        offset = 0;
+        return true;
+      }
+      return false;
     }
-    else if (type == WS_EVT_DISCONNECT)
+    if (head + size < tail)
     {
-      if (DEBUG_LOGGING)
-        Serial.printf("WebSocket client #%u disconnected\n", client->id());
+      offset = head;
+      return true;
     }
-    else if (type == WS_EVT_DATA)
-    {
-      AwsFrameInfo *info = (AwsFrameInfo *)arg;
-      if (info->final && info->opcode == WS_TEXT)
-      {
-        data[len] = 0;
+    return false;
+  }
 
-        // Check for simple "ping" message (not JSON)
-        if (strcmp((char *)data, "ping") == 0)
-        {
-          if (DEBUG_LOGGING)
-            Serial.printf("Received WebSocket ping from client #%u\n", client->id());
-          client->text("{\"status\":\"ok\",\"message\":\"pong\"}");
-          return;
-        }
+  void _commitPayload(uint16_t offset, uint16_t size)
+  {
+    _payloadHead.store((offset + size) % _payloadCapacity, std::memory_order_relaxed);
+  }
 
-        StaticJsonDocument<512> doc;
-        if (deserializeJson(doc, (char *)data) == DeserializationError::Ok)
-        {
-          const char *cmd = doc["cmd"] | "";
+  // Commands queued by _enqueueWithPayload(), they hold a payload record
+  // whatever the size of their payload
+  static bool _hasPayload(const Command &cmd)
+  {
+    switch (cmd.type)
+    {
+    case SET_PIXELS:
+    case FADE_TO_PIXELS:
+    case XOR_PIXELS:
+    case BLIT:
+    case START_EFFECT:
+    case SAVE_SCENE:
+    case LOAD_SCENE:
+    case DELETE_SCENE:
+      return true;
+    default:
+      return false;
+    }
+  }
 
-          // Handle JSON ping command
-          if (strcmp(cmd, "ping") == 0)
-          {
-            if (DEBUG_LOGGING)
-              Serial.printf("Received WebSocket ping (JSON) from client #%u\n", client->id());
-            client->text("{\"status\":\"ok\",\"message\":\"pong\"}");
-            return;
-          }
+  // Called by loop() once a command is done with its payload
+  void _releasePayload(const Command &cmd)
+  {
+    if (!_hasPayload(cmd))
+      return;
+    _payloadDone[cmd.payloadRecord % PAYLOAD_RECORDS] = true;
+    _advancePayloadTail();
+  }
 
-          // Handle getPixelCount command
-          if (strcmp(cmd, "getPixelCount") == 0)
-          {
-            if (DEBUG_LOGGING)
-              Serial.printf("Received getPixelCount from client #%u\n", client->id());
-            char response[64];
-            snprintf(response, sizeof(response), "{\"status\":\"ok\",\"pixelCount\":%u}", _numPixels);
-            client->text(response);
-            return;
-          }
+  void _advancePayloadTail()
+  {
+    uint16_t head = _payloadRecordHead.load(std::memory_order_acquire);
+    uint16_t record = _payloadRecordTail.load(std::memory_order_relaxed);
+    if (record == head || !_payloadDone[record % PAYLOAD_RECORDS])
+      return;
 
-          uint32_t id = doc["id"] | 0; // Get command ID from client
+    uint16_t tail = 0;
+    while (record != head && _payloadDone[record % PAYLOAD_RECORDS])
+    {
+      _payloadDone[record % PAYLOAD_RECORDS] = false;
+      tail = _payloadEnds[record % PAYLOAD_RECORDS];
+      record++;
+    }
+    _payloadTail.store(tail, std::memory_order_release);
+    _payloadRecordTail.store(record, std::memory_order_release);
+  }
 
-          if (id == 0)
-          {
-            // Command ID is required for non-ping commands
-            client->text("{\"status\":\"error\",\"error\":\"missing_id\"}");
-            return;
-          }
+  // Every output pixel changes with the tables
+  void _invalidateLut()
+  {
+    _lutValid = false;
+    _frame.markDirty(0, _numPixels);
+  }
 
-          Command command;
-          command.clientId = client->id();
-          command.commandId = id;
-          bool validCmd = true;
+  // Adafruit packs the byte offsets of W, R, G and B into the type. RGB
+  // types repeat the red offset for white.
+  static bool _setColorOrder(Strip &strip, neoPixelType order)
+  {
+    uint8_t w = (order >> 6) & 3, r = (order >> 4) & 3, g = (order >> 2) & 3, b = order & 3;
+    if (w != r || r == g || r == b || g == b || r > 2 || g > 2 || b > 2)
+      return false;
+    strip.rgbOffsets[0] = r;
+    strip.rgbOffsets[1] = g;
+    strip.rgbOffsets[2] = b;
+    return true;
+  }
 
-          if (strcmp(cmd, "setColor") == 0)
-          {
-            command.type = SET_COLOR;
-            command.r = doc["r"] | 0;
-            command.g = doc["g"] | 0;
-            command.b = doc["b"] | 0;
-          }
-          else if (strcmp(cmd, "clear") == 0)
-          {
-            command.type = CLEAR;
-          }
-          else if (strcmp(cmd, "setPixelColor") == 0)
-          {
-            command.type = SET_PIXEL_COLOR;
-            command.index = doc["index"] | 0;
-            command.r = doc["r"] | 0;
-            command.g = doc["g"] | 0;
-            command.b = doc["b"] | 0;
-
-            // Validate pixel index bounds
-            if (command.index >= _numPixels)
-            {
-              char errMsg[96];
-              snprintf(errMsg, sizeof(errMsg), "{\"status\":\"error\",\"error\":\"index_out_of_bounds\",\"id\":%u,\"max\":%u}", id, _numPixels - 1);
-              client->text(errMsg);
-              validCmd = false;
-            }
-          }
-          else if (strcmp(cmd, "show") == 0)
-          {
-            command.type = SHOW;
-          }
-          else if (strcmp(cmd, "setBrightness") == 0)
-          {
-            command.type = SET_BRIGHTNESS;
-            command.brightness = doc["brightness"] | 255;
-          }
-          else
-          {
-            validCmd = false;
-            char errMsg[80];
-            snprintf(errMsg, sizeof(errMsg), "{\"status\":\"error\",\"error\":\"unknown_cmd\",\"id\":%u}", id);
-            client->text(errMsg);
-          }
+  // Repeats a write to a mirrored segment on the other half, backwards
+  void _mirrorWrite(const Command &cmd)
+  {
+    const Segment &segment = _segments[((cmd.flags & CMD_SEGMENT_MASK) >> 4) - 1];
+    uint16_t count = cmd.type == SET_PIXEL_COLOR ? 1 : cmd.count;
+    uint16_t last = 2 * segment.start + segment.length - 1 - cmd.index;
+    uint16_t first = last - (count - 1);
+    if (cmd.type == SET_PIXEL_COLOR)
+    {
+      _frame.set(first, cmd.r, cmd.g, cmd.b);
+    }
+    else if (cmd.type == SET_COLOR)
+    {
+      _frame.fill(first, count, cmd.r, cmd.g, cmd.b);
+    }
+    else
+    {
+      const uint8_t *grb = _payloadBuffer + cmd.payload;
+      for (uint16_t i = 0; i < count; ++i)
+        memcpy(_frame.data() + (last - i) * 3, grb + i * 3, 3);
+      _frame.markDirty(first, count);
+    }
+  }
 
-          if (validCmd)
-          {
-            if (!enqueueCommand(command))
-            {
-              char errMsg[80];
-              snprintf(errMsg, sizeof(errMsg), "{\"status\":\"error\",\"error\":\"queue_full\",\"id\":%u}", id);
-              client->text(errMsg);
-            }
-            // ACK with ID will be sent after processing in loop()
-          }
-        }
-        else
-        {
-          client->text("{\"status\":\"error\",\"error\":\"bad_json\"}");
-        }
+  // Scatters a rectangle through the matrix table, cell is its top left
+  void _blit(uint16_t cell, uint16_t width, uint16_t height, const uint8_t *grb)
+  {
+    for (uint16_t y = 0; y < height; ++y)
+    {
+      const uint16_t *map = _matrixMap + cell + y * _matrixWidth;
+      for (uint16_t x = 0; x < width; ++x, grb += 3)
+      {
+        memcpy(_frame.data() + map[x] * 3, grb, 3);
+        _frame.markDirty(map[x], 1);
       }
     }
   }
-};
\ No newline at end of file
+
+  // Copies the back buffer to the outputs and sends it out. With
+  // asynchronous outputs this only waits for the previous frame, so preparing
+  // the next frame overlaps with the transmission of this one, and each strip
+  // starts sending before the next one is copied.
+  void _present()
+  {
+    if (!_frame.dirty())
+    {
+      // Nothing changed, the LEDs already show the back buffer
+      _stats.showsSkipped++;
+      return;
+    }
+
+    if (!_lutValid)
+    {
+      _lut.build(_brightness, _gammaCorrection, _whiteBalance);
+      _lutValid = true;
+    }
+
+    uint32_t showStart = micros();
+    for (uint8_t s = 0; s < _stripCount; ++s)
+    {
+      // Only strips overlapping the dirty range are copied and sent
+      Strip &strip = _strips[s];
+      uint16_t stripEnd = strip.offset + strip.numPixels;
+      uint16_t first = _frame.dirtyFirst() > strip.offset ? _frame.dirtyFirst() : strip.offset;
+      uint16_t end = _frame.dirtyEnd() < stripEnd ? _frame.dirtyEnd() : stripEnd;
+      if (first >= end)
+        continue;
+
+      strip.output->waitDone();
+      _lut.apply(strip.output->pixels() + (first - strip.offset) * 3, _frame.data() + first * 3, end - first,
+                 strip.rgbOffsets);
+      strip.output->showRange(first - strip.offset, end - first);
+    }
+    _frame.clean();
+    _recordDuration(_stats.frames, _stats.showTotalUs, _stats.showMaxUs, micros() - showStart);
+    _countFrame();
+    _shownFrames++;
+    _statePending.store(true, std::memory_order_relaxed);
+  }
+
+  // Sends what the LEDs show to the /ws/state observers. Each push is
+  // encoded once and shared by all of them, so more observers only cost
+  // sending. Runs where _present() runs, at most every _statePushIntervalMs.
+  void _pushState()
+  {
+    if (_statePushIntervalMs == 0 || !_statePending.load(std::memory_order_relaxed) ||
+        millis() - _lastStatePushMs < _statePushIntervalMs)
+      return;
+    if (_stateWs.count() == 0)
+    {
+      _statePending.store(false, std::memory_order_relaxed);
+      return;
+    }
+    // A slow observer delays the push for everyone rather than piling up
+    // snapshots in its queue
+    if (!_stateWs.availableForWriteAll())
+    {
+      _stats.statePushesSkipped++;
+      return;
+    }
+    _statePending.store(false, std::memory_order_relaxed);
+    _lastStatePushMs = millis();
+    _stats.statePushes++;
+
+    char text[112];
+    int len = snprintf(text, sizeof(text),
+                       "{\"event\":\"state\",\"frame\":%u,\"brightness\":%u,\"fps\":%u,\"animating\":%s}",
+                       _shownFrames, _brightness, framesPerSecond(), _animating() ? "true" : "false");
+    _stateWs.textAll(text, len);
+
+    if (!_stateFrames)
+      return;
+    uint16_t count = (_numPixels + _stateDownsample - 1) / _stateDownsample;
+    AsyncWebSocketMessageBuffer *buffer = _stateWs.makeBuffer(BINARY_HEADER_SIZE + (size_t)count * 3);
+    if (buffer == nullptr)
+      return;
+    uint8_t *out = buffer->get();
+    out[0] = BIN_SNAPSHOT;
+    out[1] = 0;
+    _writeU16(out + 2, _stateDownsample);
+    _writeU16(out + 4, count);
+    _writeU32(out + 6, _shownFrames);
+    _downsampleFrame(out + BINARY_HEADER_SIZE, _stateDownsample);
+    _stateWs.binaryAll(buffer);
+  }
+
+  // Averages every step pixels of the back buffer into one
+  void _downsampleFrame(uint8_t *out, uint8_t step) const
+  {
+    const uint8_t *in = _frame.data();
+    for (uint32_t first = 0; first < _numPixels; first += step, out += 3)
+    {
+      uint16_t n = _numPixels - first < step ? _numPixels - first : step;
+      uint16_t sum[3] = {0, 0, 0};
+      for (uint16_t i = 0; i < n; ++i, in += 3)
+        for (uint8_t c = 0; c < 3; ++c)
+          sum[c] += in[c];
+      for (uint8_t c = 0; c < 3; ++c)
+        out[c] = sum[c] / n;
+    }
+  }
+
+  static void _recordDuration(uint32_t &count, uint32_t &totalUs, uint32_t &maxUs, uint32_t us)
+  {
+    count++;
+    totalUs += us;
+    if (us > maxUs)
+      maxUs = us;
+  }
+
+  void _countFrame()
+  {
+    uint32_t now = millis();
+    _stats.fpsWindowFrames++;
+    uint32_t elapsed = now - _stats.fpsWindowStartMs;
+    if (elapsed >= RATE_WINDOW_MS)
+    {
+      _stats.fps = elapsed > 2 * RATE_WINDOW_MS ? 0 : _stats.fpsWindowFrames * 1000 / elapsed;
+      _stats.fpsWindowFrames = 0;
+      _stats.fpsWindowStartMs = now;
+    }
+  }
+
+  void _countClientMessage(uint32_t clientId)
+  {
+    uint32_t now = millis();
+    ClientStats *entry = nullptr;
+    for (uint8_t i = 0; i < STATS_MAX_CLIENTS && entry == nullptr; ++i)
+      if (_clientStats[i].clientId == clientId)
+        entry = &_clientStats[i];
+    for (uint8_t i = 0; i < STATS_MAX_CLIENTS && entry == nullptr; ++i)
+      if (_clientStats[i].clientId == 0)
+      {
+        entry = &_clientStats[i];
+        *entry = {clientId, 0, now, 0, 0};
+      }
+    if (entry == nullptr)
+      return;
+
+    entry->messages++;
+    entry->windowMessages++;
+    uint32_t elapsed = now - entry->windowStartMs;
+    if (elapsed >= RATE_WINDOW_MS)
+    {
+      entry->rate = elapsed > 2 * RATE_WINDOW_MS ? 0 : entry->windowMessages * 1000 / elapsed;
+      entry->windowMessages = 0;
+      entry->windowStartMs = now;
+    }
+  }
+
+  void _forgetClientStats(uint32_t clientId)
+  {
+    for (uint8_t i = 0; i < STATS_MAX_CLIENTS; ++i)
+      if (_clientStats[i].clientId == clientId)
+        _clientStats[i].clientId = 0;
+  }
+
+  void _formatStats(char *buffer, size_t size)
+  {
+    uint32_t now = millis();
+    int len = snprintf(buffer, size,
+                       "{\"status\":\"ok\",\"stats\":{"
+                       "\"queueDepth\":%u,\"queueHighWaterMark\":%u,\"queueCapacity\":%u,"
+                       "\"queueFull\":%u,\"badJson\":%u,"
+                       "\"parseAvgUs\":%u,\"parseMaxUs\":%u,"
+                       "\"showAvgUs\":%u,\"showMaxUs\":%u,\"frames\":%u,\"showsSkipped\":%u,\"fps\":%u,"
+                       "\"drainCount\":%u,\"drainTimeUs\":%u,\"scheduled\":%u,"
+                       "\"reassemblyBusy\":%u,\"rateLimited\":%u,\"coalesced\":%u,\"framesDropped\":%u,\"udpPackets\":%u,\"badUdp\":%u,"
+                       "\"freeHeap\":%u,\"largestFreeBlock\":%u,\"uptimeMs\":%u,"
+                       "\"objectBytes\":%u,\"queueBytes\":%u,\"frameBytes\":%u,"
+                       "\"observers\":%u,\"statePushes\":%u,\"statePushesSkipped\":%u,"
+                       "\"clients\":[",
+                       queueDepth(), queueHighWaterMark(), queueCapacity(),
+                       _stats.queueFull, _stats.badJson,
+                       _stats.parseCount ? _stats.parseTotalUs / _stats.parseCount : 0, _stats.parseMaxUs,
+                       _stats.frames ? _stats.showTotalUs / _stats.frames : 0, _stats.showMaxUs,
+                       _stats.frames, _stats.showsSkipped, framesPerSecond(),
+                       _lastDrainCount, _lastDrainTimeUs, scheduledCount(),
+                       _stats.reassemblyBusy, _stats.rateLimited, _stats.coalesced, _stats.framesDropped, _stats.udpPackets, _stats.badUdp,
+                       ESP.getFreeHeap(), ESP.getMaxAllocHeap(), now,
+                       (unsigned)objectBytes(), (unsigned)queueBytes(), (unsigned)frameBytes(),
+                       (unsigned)_stateWs.count(), _stats.statePushes, _stats.statePushesSkipped);
+
+    bool firstClient = true;
+    for (uint8_t i = 0; i < STATS_MAX_CLIENTS && len < (int)size; ++i)
+    {
+      const ClientStats &entry = _clientStats[i];
+      if (entry.clientId == 0)
+        continue;
+      uint16_t rate = now - entry.windowStartMs > 2 * RATE_WINDOW_MS ? 0 : entry.rate;
+      len += snprintf(buffer + len, size - len, "%s{\"id\":%u,\"messages\":%u,\"rate\":%u}",
+                      firstClient ? "" : ",", entry.clientId, entry.messages, rate);
+      firstClient = false;
+    }
+    if (len < (int)size)
+      snprintf(buffer + len, size - len, "]}}");
+  }
+
+  void _formatPixelCount(char *buffer, size_t size)
+  {
+    int len = snprintf(buffer, size, "{\"status\":\"ok\",\"pixelCount\":%u,", _numPixels);
+    if (_matrixMap && len < (int)size)
+      len += snprintf(buffer + len, size - len, "\"width\":%u,\"height\":%u,", _matrixWidth, _matrixHeight);
+    if (len < (int)size)
+      len += snprintf(buffer + len, size - len, "\"strips\":[");
+    for (uint8_t i = 0; i < _stripCount && len < (int)size; ++i)
+      len += snprintf(buffer + len, size - len, i ? ",%u" : "%u", _strips[i].numPixels);
+    if (len < (int)size)
+      snprintf(buffer + len, size - len, "]}");
+  }
+
+  void _sendIndexError(AsyncWebSocketClient *client, uint32_t id, uint16_t length)
+  {
+    char errMsg[96];
+    snprintf(errMsg, sizeof(errMsg), "{\"status\":\"error\",\"error\":\"index_out_of_bounds\",\"id\":%u,\"max\":%u}", id, length - 1);
+    client->text(errMsg);
+  }
+
+  // HTTP requests go through the command queue as well, so they are applied
+  // in order with WebSocket commands and never touch the back buffer from the
+  // AsyncTCP task. They are not acked, the HTTP response is sent right away.
+  void _enqueueFromHttp(AsyncWebServerRequest *request, Command command)
+  {
+    command.clientId = 0;
+    command.commandId = 0;
+    if (enqueueCommand(command))
+      request->send(200, "application/json", "{\"status\":\"ok\"}");
+    else
+      request->send(503, "application/json", "{\"status\":\"error\",\"error\":\"queue_full\"}");
+  }
+
+  static uint16_t _readU16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+  static uint32_t _readU32(const uint8_t *p)
+  {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+  static void _writeU16(uint8_t *p, uint16_t value)
+  {
+    p[0] = value;
+    p[1] = value >> 8;
+  }
+  static void _writeU32(uint8_t *p, uint32_t value)
+  {
+    _writeU16(p, value);
+    _writeU16(p + 2, value >> 16);
+  }
+
+  // Sockets can only be opened once WiFi is up, until then the port is just
+  // remembered and begin() opens it.
+  void _startUdp(UdpInput &input, uint16_t port)
+  {
+    if (input.running)
+      input.socket.stop();
+    input.port = port;
+    if (_udpBuffer == nullptr)
+      _udpBuffer = new uint8_t[UDP_BUFFER_SIZE];
+    input.running = WiFi.getMode() != WIFI_OFF && input.socket.begin(port);
+  }
+
+  void _pollUdp()
+  {
+    _pollUdp(_ddp, &NeopixelCommander::_onDdpPacket);
+    _pollUdp(_e131, &NeopixelCommander::_onE131Packet);
+    _pollUdp(_artNet, &NeopixelCommander::_onArtNetPacket);
+  }
+
+  void _pollUdp(UdpInput &input, bool (NeopixelCommander::*handler)(const uint8_t *, size_t))
+  {
+    if (!input.running)
+      return;
+    for (uint8_t i = 0; i < UDP_PACKETS_PER_POLL; ++i)
+    {
+      int size = input.socket.parsePacket();
+      if (size <= 0)
+        break;
+      int len = input.socket.read(_udpBuffer, UDP_BUFFER_SIZE);
+      _stats.udpPackets++;
+      if (len <= 0 || len != size || !(this->*handler)(_udpBuffer, len))
+        _stats.badUdp++;
+    }
+  }
+
+  // Writes RGB channel data starting at the given channel of the whole
+  // strip set, clipped to the strips.
+  void _writeRgbChannels(uint32_t channel, const uint8_t *rgb, size_t len)
+  {
+    uint32_t total = (uint32_t)_numPixels * 3;
+    if (channel >= total)
+      return;
+    if (channel + len > total)
+      len = total - channel;
+
+    // Back buffer is GRB, swap the first two channels of every pixel
+    static const uint8_t order[3] = {1, 0, 2};
+    uint16_t first = channel / 3;
+    for (size_t i = 0; i < len; ++i, ++channel)
+    {
+      uint8_t c = channel % 3;
+      _frame.data()[channel - c + order[c]] = rgb[i];
+    }
+    _frame.markDirty(first, (channel + 2) / 3 - first);
+  }
+
+  static uint16_t _readU16BE(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+  static uint32_t _readU32BE(const uint8_t *p)
+  {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  }
+
+  // DDP header: flags, sequence, data type, id, offset (uint32 BE),
+  // length (uint16 BE), followed by a 4 byte timecode if flagged.
+  bool _onDdpPacket(const uint8_t *data, size_t len)
+  {
+    static const uint8_t DDP_FLAG_VERSION_MASK = 0xc0;
+    static const uint8_t DDP_FLAG_VERSION_1 = 0x40;
+    static const uint8_t DDP_FLAG_TIMECODE = 0x10;
+    static const uint8_t DDP_FLAG_PUSH = 0x01;
+    static const uint8_t DDP_ID_DISPLAY = 1;
+
+    if (len < 10 || (data[0] & DDP_FLAG_VERSION_MASK) != DDP_FLAG_VERSION_1)
+      return false;
+    size_t headerSize = (data[0] & DDP_FLAG_TIMECODE) ? 14 : 10;
+    uint32_t offset = _readU32BE(data + 4);
+    uint16_t length = _readU16BE(data + 8);
+    if (len < headerSize + length)
+      return false;
+    // Only the default output device, other ids are status/config queries
+    if (data[3] != DDP_ID_DISPLAY && data[3] != 0)
+      return true;
+
+    _writeRgbChannels(offset, data + headerSize, length);
+    if (data[0] & DDP_FLAG_PUSH)
+      _requestShow();
+    return true;
+  }
+
+  bool _onE131Packet(const uint8_t *data, size_t len)
+  {
+    static const uint8_t ACN_ID[12] = {'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0};
+    static const uint32_t VECTOR_ROOT_DATA = 0x00000004;
+    static const uint32_t VECTOR_FRAMING_DATA = 0x00000002;
+    static const uint8_t OPTION_PREVIEW = 0x80;
+    static const uint8_t OPTION_TERMINATED = 0x40;
+
+    if (len < 126 || memcmp(data + 4, ACN_ID, sizeof(ACN_ID)) != 0 ||
+        _readU32BE(data + 18) != VECTOR_ROOT_DATA || _readU32BE(data + 40) != VECTOR_FRAMING_DATA)
+      return false;
+
+    uint8_t options = data[112];
+    if (options & (OPTION_PREVIEW | OPTION_TERMINATED))
+      return true;
+
+    uint16_t universe = _readU16BE(data + 113);
+    uint16_t valueCount = _readU16BE(data + 123); // including the start code
+    if (valueCount == 0 || len < 125 + (size_t)valueCount)
+      return false;
+    if (data[125] != 0) // only DMX512 null start code data
+      return true;
+
+    _onDmxUniverse(universe, _e131Universe, data + 126, valueCount - 1);
+    return true;
+  }
+
+  bool _onArtNetPacket(const uint8_t *data, size_t len)
+  {
+    static const uint16_t OP_DMX = 0x5000;
+    static const uint16_t OP_SYNC = 0x5200;
+
+    if (len < 10 || memcmp(data, "Art-Net", 8) != 0)
+      return false;
+
+    uint16_t opcode = _readU16(data + 8);
+    if (opcode == OP_SYNC)
+    {
+      _requestShow();
+      _resetUniverses();
+      return true;
+    }
+    if (opcode != OP_DMX)
+      return true;
+
+    if (len < 18)
+      return false;
+    uint16_t universe = ((data[15] & 0x7f) << 8) | data[14];
+    uint16_t length = _readU16BE(data + 16);
+    if (len < 18 + (size_t)length)
+      return false;
+
+    _onDmxUniverse(universe, _artNetUniverse, data + 18, length);
+    return true;
+  }
+
+  void _onDmxUniverse(uint16_t universe, uint16_t startUniverse, const uint8_t *channels, size_t count)
+  {
+    if (universe < startUniverse)
+      return;
+    uint16_t index = universe - startUniverse;
+    uint16_t universeCount = (_numPixels + DMX_PIXELS_PER_UNIVERSE - 1) / DMX_PIXELS_PER_UNIVERSE;
+    if (index >= universeCount)
+      return;
+
+    // A universe that was already received starts the next frame
+    if (_universesReceived[index / 32] & (1u << (index % 32)))
+    {
+      _requestShow();
+      _resetUniverses();
+    }
+
+    if (count > DMX_PIXELS_PER_UNIVERSE * 3)
+      count = DMX_PIXELS_PER_UNIVERSE * 3;
+    _writeRgbChannels((uint32_t)index * DMX_PIXELS_PER_UNIVERSE * 3, channels, count);
+
+    _universesReceived[index / 32] |= 1u << (index % 32);
+    if (_allUniversesReceived(universeCount))
+    {
+      _requestShow();
+      _resetUniverses();
+    }
+  }
+
+  // True once all universeCount universes have been received
+  bool _allUniversesReceived(uint16_t universeCount) const
+  {
+    for (uint16_t i = 0; i < universeCount; ++i)
+      if (!(_universesReceived[i / 32] & (1u << (i % 32))))
+        return false;
+    return true;
+  }
+
+  void _resetUniverses()
+  {
+    memset(_universesReceived, 0, sizeof(_universesReceived));
+  }
+
+  // Queues a command whose payload has already been written at
+  // command.payload. The payload is claimed before the command becomes
+  // visible to loop(), and handed back if the command cannot be queued.
+  void _enqueueWithPayload(AsyncWebSocketClient *client, Command command, uint16_t size)
+  {
+    uint16_t record = _payloadRecordHead.load(std::memory_order_relaxed);
+    if ((uint16_t)(record - _payloadRecordTail.load(std::memory_order_acquire)) >= PAYLOAD_RECORDS)
+    {
+      _stats.queueFull++;
+      _sendError(client, "queue_full", command.commandId);
+      return;
+    }
+    _payloadEnds[record % PAYLOAD_RECORDS] = (command.payload + size) % _payloadCapacity;
+    command.payloadRecord = record;
+
+    uint16_t previousHead = _payloadHead.load(std::memory_order_relaxed);
+    _commitPayload(command.payload, size);
+    if (!enqueueCommand(command))
+    {
+      _payloadHead.store(previousHead, std::memory_order_relaxed);
+      _sendError(client, "queue_full", command.commandId);
+      return;
+    }
+    // Published after the command, loop() may already have released it
+    _payloadRecordHead.store(record + 1, std::memory_order_release);
+  }
+
+  // Commands may be scheduled up to SCHEDULE_MAX_AHEAD_MS ahead, times in
+  // the past run right away
+  bool _checkTime(AsyncWebSocketClient *client, uint32_t at, uint32_t id)
+  {
+    if (at != 0 && (int32_t)(at - syncedMillis()) > SCHEDULE_MAX_AHEAD_MS)
+    {
+      _sendError(client, "bad_time", id);
+      return false;
+    }
+    return true;
+  }
+
+  // Looks up the "segment" field, segment stays nullptr if there is none.
+  // Sends an error and returns false for an unknown segment.
+  bool _resolveSegment(AsyncWebSocketClient *client, const CommandFields &fields, uint32_t id,
+                       const Segment *&segment)
+  {
+    segment = nullptr;
+    if (fields.segmentName)
+    {
+      for (uint8_t i = 0; i < _segmentCount && segment == nullptr; ++i)
+        if (CommandParser::keyIs(fields.segmentName, fields.segmentNameLength, _segments[i].name))
+          segment = &_segments[i];
+    }
+    else if (fields.segment >= 0 && fields.segment < _segmentCount)
+    {
+      segment = &_segments[fields.segment];
+    }
+    if (segment == nullptr && (fields.segmentName || fields.segment >= 0))
+    {
+      _sendError(client, "unknown_segment", id);
+      return false;
+    }
+    return true;
+  }
+
+  // Pixels a segment can be addressed with
+  static uint16_t _segmentLength(const Segment &segment)
+  {
+    return segment.mirror ? (segment.length + 1) / 2 : segment.length;
+  }
+
+  // Points command at count pixels from index start of the segment on. A
+  // reversed segment runs backwards, returns true if pixel data has to be
+  // reversed to match. Writes to mirrored segments are repeated by loop().
+  bool _mapSegment(Command &command, const Segment &segment, uint16_t start, uint16_t count)
+  {
+    command.index = segment.start + (segment.reverse ? _segmentLength(segment) - start - count : start);
+    command.count = count;
+    if (segment.mirror)
+      command.flags |= (&segment - _segments + 1) << 4;
+    return segment.reverse;
+  }
+
+  // Resolves the "strip", "start" and "count" fields into a range of the
+  // back buffer. count 0 means up to the end of the strip. A "segment" is
+  // always covered as a whole. Sends an error and returns false if the range
+  // is invalid.
+  bool _resolveRange(AsyncWebSocketClient *client, const CommandFields &fields, uint32_t id,
+                     uint16_t &first, uint16_t &count)
+  {
+    const Segment *segment;
+    if (!_resolveSegment(client, fields, id, segment))
+      return false;
+    if (segment)
+    {
+      first = segment->start;
+      count = segment->length;
+      return true;
+    }
+
+    uint16_t length = _numPixels;
+    first = 0;
+    if (fields.strip >= 0)
+    {
+      if (fields.strip >= _stripCount)
+      {
+        _sendError(client, "unknown_strip", id);
+        return false;
+      }
+      first = _strips[fields.strip].offset;
+      length = _strips[fields.strip].numPixels;
+    }
+    if (fields.start >= length || !CommandParser::rangeFits(fields.start, fields.count, length))
+    {
+      _sendIndexError(client, id, length);
+      return false;
+    }
+    first += fields.start;
+    count = fields.count > 0 ? fields.count : length - fields.start;
+    return true;
+  }
+
+  static EffectType _lookupEffect(const char *name)
+  {
+    if (strcmp(name, "rainbow") == 0)
+      return EFFECT_RAINBOW;
+    if (strcmp(name, "chase") == 0)
+      return EFFECT_CHASE;
+    if (strcmp(name, "fade") == 0)
+      return EFFECT_FADE;
+    if (strcmp(name, "noise") == 0)
+      return EFFECT_NOISE;
+    if (strcmp(name, "gradient") == 0)
+      return EFFECT_GRADIENT;
+    return EFFECT_NONE;
+  }
+
+  // startEffect: {"cmd":"startEffect","id":1,"effect":"chase","colors":["ff0000",0],
+  // "period":2000,"size":3,"reverse":false} plus the usual strip/start/count.
+  // The parameters travel through the payload buffer so the effect starts in
+  // order with the other queued commands.
+  void _onStartEffect(AsyncWebSocketClient *client, const JsonDocument &doc, const CommandFields &fields)
+  {
+    uint32_t id = fields.id;
+    Effect effect = {};
+    effect.type = _lookupEffect(doc["effect"] | "");
+    if (effect.type == EFFECT_NONE)
+    {
+      _sendError(client, "unknown_effect", id);
+      return;
+    }
+    const Segment *segment;
+    if (!_checkTime(client, fields.at, id) || !_resolveRange(client, fields, id, effect.start, effect.count) ||
+        !_resolveSegment(client, fields, id, segment))
+      return;
+    effect.segment = segment ? segment - _segments + 1 : 0;
+    effect.period = doc["period"] | 2000;
+    if (effect.period == 0)
+      effect.period = 1;
+    effect.size = doc["size"] | 3;
+    if (effect.size == 0)
+      effect.size = 1;
+    effect.reverse = doc["reverse"] | false;
+
+    JsonArrayConst colors = doc["colors"].as<JsonArrayConst>();
+    for (JsonVariantConst value : colors)
+    {
+      if (effect.paletteSize == MAX_PALETTE_SIZE)
+        break;
+      uint32_t color;
+      if (value.is<const char *>())
+      {
+        const char *hex = value.as<const char *>();
+        if (!CommandParser::parseHexColor(hex, strlen(hex), color))
+        {
+          _sendError(client, "bad_color", id);
+          return;
+        }
+      }
+      else
+      {
+        color = value | 0u;
+      }
+      effect.palette[effect.paletteSize++] = color;
+    }
+    if (effect.paletteSize == 0)
+      effect.palette[effect.paletteSize++] = 0xffffff;
+
+    uint16_t offset;
+    if (!_reservePayload(sizeof(Effect), offset))
+    {
+      _stats.queueFull++;
+      _sendError(client, "queue_full", id);
+      return;
+    }
+    memcpy(_payloadBuffer + offset, &effect, sizeof(Effect));
+
+    Command command = {};
+    command.type = START_EFFECT;
+    command.clientId = client->id();
+    command.commandId = id;
+    command.flags = fields.noAck ? BIN_FLAG_NO_ACK : 0;
+    command.payload = offset;
+    command.at = fields.at;
+    _enqueueWithPayload(client, command, sizeof(Effect));
+  }
+
+  void _onStopEffect(AsyncWebSocketClient *client, const CommandFields &fields)
+  {
+    Command command = {};
+    command.type = STOP_EFFECT;
+    command.clientId = client->id();
+    command.commandId = fields.id;
+    command.flags = fields.noAck ? BIN_FLAG_NO_ACK : 0;
+    command.at = fields.at;
+    if (!_checkTime(client, fields.at, fields.id) ||
+        !_resolveRange(client, fields, fields.id, command.index, command.count))
+      return;
+    if (!enqueueCommand(command))
+      _sendError(client, "queue_full", fields.id);
+  }
+
+  // saveScene, loadScene, deleteScene: {"cmd":"loadScene","id":1,"name":"evening","show":true}.
+  // Queued like pixel commands, so a save sees everything sent before it.
+  void _onScene(AsyncWebSocketClient *client, const JsonDocument &doc, const CommandFields &fields, CommandType type)
+  {
+    uint32_t id = fields.id;
+    const char *name = doc["name"] | "";
+    size_t len = strlen(name);
+    if (!_validSceneName(name, len))
+    {
+      _sendError(client, "bad_name", id);
+      return;
+    }
+    if (!_checkTime(client, fields.at, id))
+      return;
+
+    uint16_t offset;
+    if (!_reservePayload(SCENE_NAME_SIZE, offset))
+    {
+      _stats.queueFull++;
+      _sendError(client, "queue_full", id);
+      return;
+    }
+    memset(_payloadBuffer + offset, 0, SCENE_NAME_SIZE);
+    memcpy(_payloadBuffer + offset, name, len);
+
+    Command command = {};
+    command.type = type;
+    command.clientId = client->id();
+    command.commandId = id;
+    command.flags = (fields.noAck ? BIN_FLAG_NO_ACK : 0) | (type == LOAD_SCENE && fields.show ? BIN_FLAG_SHOW : 0);
+    command.payload = offset;
+    command.at = fields.at;
+    _enqueueWithPayload(client, command, SCENE_NAME_SIZE);
+  }
+
+  // Effects own their range, a new effect replaces all effects it overlaps
+  // Returns false if all MAX_EFFECTS slots are taken by other ranges
+  bool _startEffect(const Effect &effect)
+  {
+    _stopEffects(effect.start, effect.count);
+    _stopTransitions(effect.start, effect.count);
+    for (uint8_t i = 0; i < MAX_EFFECTS; ++i)
+    {
+      if (_effects[i].type == EFFECT_NONE)
+      {
+        _effects[i] = effect;
+        _effects[i].startedMs = millis();
+        _activeEffects++;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void _stopEffects(uint16_t start, uint16_t count)
+  {
+    for (uint8_t i = 0; i < MAX_EFFECTS; ++i)
+    {
+      Effect &effect = _effects[i];
+      if (effect.type != EFFECT_NONE && effect.start < start + count && start < effect.start + effect.count)
+      {
+        effect.type = EFFECT_NONE;
+        _activeEffects--;
+      }
+    }
+  }
+
+  // Renders one frame of every running effect into the back buffer
+  void _renderEffects()
+  {
+    uint32_t now = millis();
+    for (uint8_t i = 0; i < MAX_EFFECTS; ++i)
+      if (_effects[i].type != EFFECT_NONE)
+        _renderEffect(_effects[i], now - _effects[i].startedMs);
+  }
+
+  void _renderEffect(const Effect &effect, uint32_t elapsedMs)
+  {
+    // Position within the current period, 0..65535
+    uint16_t phase = (uint64_t)(elapsedMs % effect.period) * 65536 / effect.period;
+    const Segment *segment = effect.segment ? &_segments[effect.segment - 1] : nullptr;
+    uint16_t count = segment ? _segmentLength(*segment) : effect.count;
+
+    for (uint16_t i = 0; i < count; ++i)
+    {
+      uint16_t n = effect.reverse ? count - 1 - i : i;
+      uint32_t color = 0;
+      switch (effect.type)
+      {
+      case EFFECT_RAINBOW:
+        color = Adafruit_NeoPixel::ColorHSV((uint32_t)n * 65536 / count + phase);
+        break;
+      case EFFECT_CHASE:
+      {
+        uint16_t head = (uint32_t)phase * count >> 16;
+        uint16_t distance = (n + count - head) % count;
+        color = distance < effect.size ? effect.palette[0] : _paletteColor(effect, 1);
+        break;
+      }
+      case EFFECT_FADE:
+        // sine8() is 0 at 192, so every period starts dark
+        color = _blend(_paletteColor(effect, 1), effect.palette[0],
+                       Adafruit_NeoPixel::sine8((phase >> 8) + 192));
+        break;
+      case EFFECT_NOISE:
+        color = _samplePalette(effect, _noise8(((uint32_t)n << 8) / effect.size + (phase >> 4)), false);
+        break;
+      case EFFECT_GRADIENT:
+        color = _samplePalette(effect, (uint32_t)n * 256 / count + (phase >> 8), true);
+        break;
+      case EFFECT_NONE:
+        break;
+      }
+      if (segment)
+        _setSegmentPixel(*segment, i, color >> 16, color >> 8, color);
+      else
+        _frame.set(effect.start + i, color >> 16, color >> 8, color);
+    }
+  }
+
+  void _setSegmentPixel(const Segment &segment, uint16_t i, uint8_t r, uint8_t g, uint8_t b)
+  {
+    uint16_t n = segment.start + (segment.reverse ? _segmentLength(segment) - 1 - i : i);
+    _frame.set(n, r, g, b);
+    if (segment.mirror)
+      _frame.set(2 * segment.start + segment.length - 1 - n, r, g, b);
+  }
+
+  // Missing palette entries are black
+  static uint32_t _paletteColor(const Effect &effect, uint8_t index)
+  {
+    return index < effect.paletteSize ? effect.palette[index] : 0;
+  }
+
+  // Linear interpolation between a and b, t = 0..255
+  static uint32_t _blend(uint32_t a, uint32_t b, uint8_t t)
+  {
+    uint32_t result = 0;
+    for (uint8_t shift = 0; shift <= 16; shift += 8)
+    {
+      int32_t ca = (a >> shift) & 0xff;
+      int32_t cb = (b >> shift) & 0xff;
+      result |= (uint32_t)(ca + ((cb - ca) * t >> 8)) << shift;
+    }
+    return result;
+  }
+
+  // Maps 0..255 onto the palette. With wrap the last color blends back into
+  // the first one, so scrolling gradients have no seam.
+  static uint32_t _samplePalette(const Effect &effect, uint8_t position, bool wrap)
+  {
+    if (effect.paletteSize == 1)
+      return wrap ? effect.palette[0] : _blend(0, effect.palette[0], position);
+    uint8_t segments = wrap ? effect.paletteSize : effect.paletteSize - 1;
+    uint16_t scaled = position * segments;
+    uint8_t index = scaled >> 8;
+    uint8_t next = index + 1 < effect.paletteSize ? index + 1 : 0;
+    return _blend(effect.palette[index], effect.palette[next], scaled & 0xff);
+  }
+
+  static uint8_t _hash8(uint32_t x)
+  {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+  }
+
+  // Smooth 1D value noise, x in 8.8 fixed point
+  static uint8_t _noise8(uint32_t x)
+  {
+    int32_t a = _hash8(x >> 8);
+    int32_t b = _hash8((x >> 8) + 1);
+    uint32_t f = x & 0xff;
+    uint32_t smooth = (f * f * (3 * 256 - 2 * f)) >> 16; // smoothstep, 0..255
+    return a + ((b - a) * (int32_t)smooth >> 8);
+  }
+
+  // Starts fading count pixels from index to the GRB target, or to r, g, b
+  // if target is null. The current back buffer is the starting point, so a
+  // transition can pick up where an interrupted one stopped.
+  void _startTransition(uint16_t index, uint16_t count, const uint8_t *target,
+                        uint8_t r, uint8_t g, uint8_t b, uint16_t durationMs)
+  {
+    _stopEffects(index, count);
+    _stopTransitions(index, count);
+
+    if (_transitionFrom == nullptr)
+    {
+      _transitionFrom = new uint8_t[_numPixels * 3];
+      _transitionTo = new uint8_t[_numPixels * 3];
+    }
+    uint8_t *to = _transitionTo + index * 3;
+    if (target)
+    {
+      memcpy(to, target, count * 3);
+    }
+    else
+    {
+      for (uint16_t i = 0; i < count; ++i, to += 3)
+      {
+        to[0] = g;
+        to[1] = r;
+        to[2] = b;
+      }
+    }
+
+    if (durationMs == 0)
+    {
+      _frame.write(index, count, _transitionTo + index * 3);
+      _requestShow();
+      return;
+    }
+    memcpy(_transitionFrom + index * 3, _frame.data() + index * 3, count * 3);
+
+    for (uint8_t i = 0; i < MAX_TRANSITIONS; ++i)
+    {
+      if (_transitions[i].count == 0)
+      {
+        _transitions[i].start = index;
+        _transitions[i].count = count;
+        _transitions[i].durationMs = durationMs;
+        _transitions[i].startedMs = millis();
+        _activeTransitions++;
+        return;
+      }
+    }
+    // No free slot, jump to the target
+    _frame.write(index, count, _transitionTo + index * 3);
+    _requestShow();
+  }
+
+  // Overlapping transitions stop where they are
+  void _stopTransitions(uint16_t start, uint16_t count)
+  {
+    for (uint8_t i = 0; i < MAX_TRANSITIONS; ++i)
+    {
+      Transition &transition = _transitions[i];
+      if (transition.count > 0 && transition.start < start + count && start < transition.start + transition.count)
+      {
+        transition.count = 0;
+        _activeTransitions--;
+      }
+    }
+  }
+
+  void _renderTransitions()
+  {
+    uint32_t now = millis();
+    for (uint8_t i = 0; i < MAX_TRANSITIONS; ++i)
+    {
+      Transition &transition = _transitions[i];
+      if (transition.count == 0)
+        continue;
+
+      uint32_t elapsed = now - transition.startedMs;
+      size_t begin = transition.start * 3;
+      size_t end = begin + transition.count * 3;
+      if (elapsed >= transition.durationMs)
+      {
+        _frame.write(transition.start, transition.count, _transitionTo + begin);
+        transition.count = 0;
+        _activeTransitions--;
+        continue;
+      }
+
+      // 16.16 fixed point progress, exact at both ends
+      int32_t t = (elapsed << 16) / transition.durationMs;
+      for (size_t n = begin; n < end; ++n)
+      {
+        int32_t from = _transitionFrom[n];
+        _frame.data()[n] = from + (((_transitionTo[n] - from) * t) >> 16);
+      }
+      _frame.markDirty(transition.start, transition.count);
+    }
+  }
+
+  bool _animating() const
+  {
+    return _activeEffects > 0 || _activeTransitions > 0;
+  }
+
+  void _renderAnimations()
+  {
+    _renderEffects();
+    _renderTransitions();
+  }
+
+  // setPixels: {"cmd":"setPixels","start":0,"hex":"ff000000ff00"} or
+  // {"cmd":"setPixels","start":0,"colors":[16711680,65280]}. The colors are
+  // converted to GRB right away and queued as a single SET_PIXELS command.
+  // Number of pixels in "hex" or "colors", sends an error if there are none
+  // or they are malformed
+  bool _countPixels(AsyncWebSocketClient *client, const CommandFields &fields, uint32_t id, uint32_t &count)
+  {
+    if (fields.hex)
+    {
+      if (fields.hexLength % 6 != 0)
+      {
+        _sendError(client, "bad_color", id);
+        return false;
+      }
+      count = fields.hexLength / 6;
+    }
+    else if (fields.colors)
+    {
+      if (!CommandParser::scanColorList(fields.colors, fields.colorsLength, nullptr, count))
+      {
+        _sendError(client, "bad_color", id);
+        return false;
+      }
+    }
+    else if (!fields.colorsArray.isNull())
+    {
+      count = fields.colorsArray.size();
+    }
+    else
+    {
+      _sendError(client, "missing_params", id);
+      return false;
+    }
+    return true;
+  }
+
+  // Writes the count pixels counted by _countPixels() to out as GRB
+  bool _decodePixels(AsyncWebSocketClient *client, const CommandFields &fields, uint32_t id,
+                     uint8_t *out, uint32_t count)
+  {
+    if (fields.hex)
+    {
+      for (uint32_t i = 0; i < count; ++i, out += 3)
+      {
+        uint32_t color;
+        if (!CommandParser::parseHexColor(fields.hex + i * 6, 6, color))
+        {
+          _sendError(client, "bad_color", id);
+          return false;
+        }
+        CommandParser::packGrb(out, color);
+      }
+    }
+    else if (fields.colors)
+    {
+      CommandParser::scanColorList(fields.colors, fields.colorsLength, out, count);
+    }
+    else
+    {
+      // Iterate instead of indexing, array lookups are linear
+      for (JsonVariantConst value : fields.colorsArray)
+      {
+        CommandParser::packGrb(out, value | 0u);
+        out += 3;
+      }
+    }
+    return true;
+  }
+
+  void _onSetPixels(AsyncWebSocketClient *client, const CommandFields &fields, Command &command,
+                    uint16_t first, uint16_t length, const Segment *segment = nullptr)
+  {
+    uint32_t id = command.commandId;
+    uint32_t count;
+    if (!_countPixels(client, fields, id, count))
+      return;
+
+    if (count == 0 || fields.start < 0 || fields.start + count > length)
+    {
+      _sendIndexError(client, id, length);
+      return;
+    }
+    uint32_t size = count * 3;
+    if (size >= _payloadCapacity)
+    {
+      _sendError(client, "payload_too_large", id);
+      return;
+    }
+
+    uint16_t offset;
+    if (!_reservePayload(size, offset))
+    {
+      _stats.queueFull++;
+      _sendError(client, "queue_full", id);
+      return;
+    }
+    if (!_decodePixels(client, fields, id, _payloadBuffer + offset, count))
+      return;
+
+    command.index = first + fields.start;
+    command.count = count;
+    if (segment && _mapSegment(command, *segment, fields.start, count))
+      _reversePixels(_payloadBuffer + offset, count);
+    command.payload = offset;
+    if (fields.show)
+      command.flags |= BIN_FLAG_SHOW;
+    _enqueueWithPayload(client, command, size);
+  }
+
+  static void _reversePixels(uint8_t *grb, uint16_t count)
+  {
+    for (uint8_t *a = grb, *b = grb + (count - 1) * 3; a < b; a += 3, b -= 3)
+      for (uint8_t c = 0; c < 3; ++c)
+      {
+        uint8_t t = a[c];
+        a[c] = b[c];
+        b[c] = t;
+      }
+  }
+
+  // setFrame: {"cmd":"setFrame","id":1,"hex":"..."} with exactly one color per
+  // pixel of all strips, shown as soon as loop() gets to it. Frames bypass
+  // the schedule, so "at" is refused.
+  void _onSetFrame(AsyncWebSocketClient *client, const CommandFields &fields, const Command &command)
+  {
+    uint32_t id = command.commandId;
+    if (command.at != 0)
+    {
+      _sendError(client, "bad_time", id);
+      return;
+    }
+    uint32_t count;
+    if (!_countPixels(client, fields, id, count))
+      return;
+    if (count != _numPixels)
+    {
+      _sendError(client, "bad_length", id);
+      return;
+    }
+    uint8_t *pixels = _frameSlotPixels();
+    if (pixels == nullptr)
+    {
+      _sendError(client, "payload_too_large", id);
+      return;
+    }
+    if (!_decodePixels(client, fields, id, pixels, count))
+      return;
+    _publishFrame(command);
+  }
+
+  // Handles the commands known to CommandFields. Returns false for any other
+  // command, which is then handled by the ArduinoJson code in _onWsEvent().
+  bool _dispatchCommand(AsyncWebSocketClient *client, const CommandFields &fields)
+  {
+    JsonCommand name = CommandParser::lookup(fields.cmd, fields.cmdLength);
+    if (name == JSON_UNKNOWN)
+      return false;
+
+    // Handle JSON ping command
+    if (name == JSON_PING)
+    {
+      NEOPIXEL_LOG_DEBUG("Received WebSocket ping (JSON) from client #%u\n", client->id());
+      client->text("{\"status\":\"ok\",\"message\":\"pong\"}");
+      return true;
+    }
+
+    // Handle getStats command
+    if (name == JSON_GET_STATS)
+    {
+      char response[STATS_BUFFER_SIZE];
+      _formatStats(response, sizeof(response));
+      client->text(response);
+      return true;
+    }
+
+    // Clock sync: clients read the device time with getTime and correct for
+    // half the round trip, or set it directly with syncTime
+    if (name == JSON_GET_TIME || name == JSON_SYNC_TIME)
+    {
+      if (name == JSON_SYNC_TIME)
+      {
+        if (!fields.hasTime)
+        {
+          client->text("{\"status\":\"error\",\"error\":\"missing_params\"}");
+          return true;
+        }
+        setClock(fields.time);
+      }
+      char response[48];
+      snprintf(response, sizeof(response), "{\"status\":\"ok\",\"time\":%u}", syncedMillis());
+      client->text(response);
+      return true;
+    }
+
+    // Handle getPixelCount command
+    if (name == JSON_GET_PIXEL_COUNT)
+    {
+      NEOPIXEL_LOG_DEBUG("Received getPixelCount from client #%u\n", client->id());
+      char response[96 + MAX_STRIPS * 6];
+      _formatPixelCount(response, sizeof(response));
+      client->text(response);
+      return true;
+    }
+
+    uint32_t id = fields.id; // Get command ID from client
+
+    if (id == 0)
+    {
+      // Command ID is required for non-ping commands
+      client->text("{\"status\":\"error\",\"error\":\"missing_id\"}");
+      return true;
+    }
+
+    // Pixel commands address all strips unless "strip" is given,
+    // indices are then relative to that strip.
+    uint16_t first = 0;
+    uint16_t length = _numPixels;
+    if (fields.strip >= 0)
+    {
+      if (fields.strip >= _stripCount)
+      {
+        _sendError(client, "unknown_strip", id);
+        return true;
+      }
+      first = _strips[fields.strip].offset;
+      length = _strips[fields.strip].numPixels;
+    }
+    // A segment replaces the strip, mirrored ones span twice their length
+    const Segment *segment;
+    if (!_resolveSegment(client, fields, id, segment))
+      return true;
+    uint16_t span = length;
+    if (segment)
+    {
+      first = segment->start;
+      length = _segmentLength(*segment);
+      span = segment->length;
+    }
+
+    if (!_checkTime(client, fields.at, id))
+      return true;
+
+    Command command = {};
+    command.clientId = client->id();
+    CommandTarget target = {first, length, span};
+    switch (CommandParser::toCommand(name, fields, target, command))
+    {
+    case COMMAND_OK:
+      if (segment && name == JSON_SET_PIXEL_COLOR)
+        _mapSegment(command, *segment, fields.index, 1);
+      else if (segment && name == JSON_FILL_RANGE)
+        _mapSegment(command, *segment, fields.start, fields.count);
+      break;
+    case COMMAND_BAD_INDEX:
+      _sendIndexError(client, id, length);
+      return true;
+    case COMMAND_BAD_COLOR:
+      _sendError(client, "bad_color", id);
+      return true;
+    case COMMAND_UNHANDLED:
+      switch (name)
+      {
+      case JSON_SET_PIXELS:
+        command.type = SET_PIXELS;
+        _onSetPixels(client, fields, command, first, length, segment);
+        return true;
+      case JSON_SET_FRAME:
+        _onSetFrame(client, fields, command);
+        return true;
+      case JSON_FADE_TO:
+        if (fields.duration < 0 || fields.duration > 0xffff)
+        {
+          _sendError(client, "bad_duration", id);
+          return true;
+        }
+        command.duration = fields.duration;
+        if (fields.hex || fields.colors || !fields.colorsArray.isNull())
+        {
+          // Full frame target, encoded like setPixels. Transitions do not
+          // repeat themselves on the mirrored half.
+          if (segment && segment->mirror)
+          {
+            _sendError(client, "bad_segment", id);
+            return true;
+          }
+          command.type = FADE_TO_PIXELS;
+          _onSetPixels(client, fields, command, first, length, segment);
+          return true;
+        }
+        if (fields.badColor)
+        {
+          _sendError(client, "bad_color", id);
+          return true;
+        }
+        if (!_resolveRange(client, fields, id, command.index, command.count))
+          return true;
+        command.type = FADE_TO;
+        command.r = fields.hasColor ? (uint8_t)(fields.color >> 16) : fields.r;
+        command.g = fields.hasColor ? (uint8_t)(fields.color >> 8) : fields.g;
+        command.b = fields.hasColor ? (uint8_t)fields.color : fields.b;
+        break;
+      default:
+        return false;
+      }
+      break;
+    }
+
+    if (!enqueueCommand(command))
+      _sendError(client, "queue_full", id);
+    // ACK with ID will be sent after processing in loop()
+    return true;
+  }
+
+  void _sendError(AsyncWebSocketClient *client, const char *error, uint32_t id)
+  {
+    char errMsg[96];
+    snprintf(errMsg, sizeof(errMsg), "{\"status\":\"error\",\"error\":\"%s\",\"id\":%u}", error, id);
+    client->text(errMsg);
+  }
+
+  // For errors found by loop() after the command was queued
+  void _sendError(uint32_t clientId, const char *error, uint32_t id)
+  {
+    AsyncWebSocketClient *client = clientId ? _ws.client(clientId) : nullptr;
+    if (client && client->status() == WS_CONNECTED)
+      _sendError(client, error, id);
+  }
+
+  bool _decodeBinaryPixels(uint8_t opcode, const uint8_t *in, size_t len, uint8_t *out, uint16_t count)
+  {
+    switch (opcode)
+    {
+    case BIN_SET_INDEXED:
+      if (len != count)
+        return false;
+      for (uint16_t i = 0; i < count; ++i, out += 3)
+        memcpy(out, _palette + in[i] * 3, 3);
+      return true;
+    case BIN_SET_RLE:
+      return _decodeRle(in, len, out, count);
+    case BIN_SET_DELTA:
+      return _decodeDelta(in, len, out, count * 3);
+    default:
+      memcpy(out, in, count * 3);
+      return true;
+    }
+  }
+
+  static bool _decodeRle(const uint8_t *in, size_t len, uint8_t *out, uint16_t count)
+  {
+    uint32_t n = 0;
+    for (; len >= 4; in += 4, len -= 4)
+    {
+      uint16_t run = in[0] + 1;
+      if (n + run > count)
+        return false;
+      for (uint16_t i = 0; i < run; ++i, out += 3)
+        memcpy(out, in + 1, 3);
+      n += run;
+    }
+    return len == 0 && n == count;
+  }
+
+  // XOR delta bytes, run length coded: a token t < 0x80 is followed by t + 1
+  // literal bytes, t >= 0x80 stands for (t & 0x7f) + 1 zero bytes, i.e.
+  // unchanged channels.
+  static bool _decodeDelta(const uint8_t *in, size_t len, uint8_t *out, uint32_t size)
+  {
+    uint32_t n = 0;
+    while (len > 0)
+    {
+      uint8_t token = *in++;
+      len--;
+      uint8_t run = (token & 0x7f) + 1;
+      if (n + run > size)
+        return false;
+      if (token < 0x80)
+      {
+        if (len < run)
+          return false;
+        memcpy(out + n, in, run);
+        in += run;
+        len -= run;
+      }
+      else
+      {
+        memset(out + n, 0, run);
+      }
+      n += run;
+    }
+    return n == size;
+  }
+
+  void _onBinaryMessage(AsyncWebSocketClient *client, const uint8_t *data, size_t len)
+  {
+    if (len < BINARY_HEADER_SIZE)
+    {
+      client->text("{\"status\":\"error\",\"error\":\"bad_header\"}");
+      return;
+    }
+
+    uint8_t opcode = data[0];
+    uint32_t id = _readU32(data + 6);
+    if (id == 0)
+    {
+      client->text("{\"status\":\"error\",\"error\":\"missing_id\"}");
+      return;
+    }
+
+    uint8_t stripIndex = data[1] >> 4;
+    if (stripIndex >= _stripCount)
+    {
+      _sendError(client, "unknown_strip", id);
+      return;
+    }
+    const Strip &strip = _strips[stripIndex];
+
+    Command command = {};
+    command.clientId = client->id();
+    command.commandId = id;
+    command.flags = data[1] & BIN_FLAG_MASK;
+
+    size_t headerSize = BINARY_HEADER_SIZE;
+    if (command.flags & BIN_FLAG_AT)
+    {
+      if (len < BINARY_HEADER_SIZE + 4)
+      {
+        client->text("{\"status\":\"error\",\"error\":\"bad_header\"}");
+        return;
+      }
+      command.at = _readU32(data + BINARY_HEADER_SIZE);
+      if (!_checkTime(client, command.at, id))
+        return;
+      headerSize += 4;
+    }
+
+    if (opcode == BIN_SHOW)
+    {
+      command.type = SHOW;
+    }
+    else if (opcode == BIN_SET_FRAME)
+    {
+      if (command.flags & BIN_FLAG_AT)
+      {
+        _sendError(client, "bad_time", id);
+        return;
+      }
+      if (_readU16(data + 2) != 0 || _readU16(data + 4) != _numPixels || len - headerSize != _numPixels * 3u)
+      {
+        _sendError(client, "bad_length", id);
+        return;
+      }
+      uint8_t *pixels = _frameSlotPixels();
+      if (pixels == nullptr)
+      {
+        _sendError(client, "payload_too_large", id);
+        return;
+      }
+      memcpy(pixels, data + headerSize, _numPixels * 3);
+      _publishFrame(command);
+      return;
+    }
+    else if (opcode == BIN_BLIT)
+    {
+      uint16_t x = _readU16(data + 2);
+      uint16_t y = _readU16(data + 4);
+      if (_matrixMap == nullptr)
+      {
+        _sendError(client, "no_matrix", id);
+        return;
+      }
+      if (len < headerSize + 4)
+      {
+        _sendError(client, "bad_length", id);
+        return;
+      }
+      uint16_t width = _readU16(data + headerSize);
+      uint16_t height = _readU16(data + headerSize + 2);
+      uint32_t size = (uint32_t)width * height * 3;
+      if (width == 0 || height == 0 || (uint32_t)x + width > _matrixWidth || (uint32_t)y + height > _matrixHeight)
+      {
+        _sendError(client, "index_out_of_bounds", id);
+        return;
+      }
+      if (len - headerSize - 4 != size)
+      {
+        _sendError(client, "bad_length", id);
+        return;
+      }
+      if (size >= _payloadCapacity)
+      {
+        _sendError(client, "payload_too_large", id);
+        return;
+      }
+
+      uint16_t offset;
+      if (!_reservePayload(size, offset))
+      {
+        _stats.queueFull++;
+        _sendError(client, "queue_full", id);
+        return;
+      }
+      memcpy(_payloadBuffer + offset, data + headerSize + 4, size);
+
+      command.type = BLIT;
+      command.index = y * _matrixWidth + x;
+      command.count = width * height;
+      command.duration = width;
+      command.payload = offset;
+      _enqueueWithPayload(client, command, size);
+      return;
+    }
+    else if (opcode == BIN_SET_PALETTE)
+    {
+      uint16_t start = _readU16(data + 2);
+      uint16_t count = _readU16(data + 4);
+      if (start + count > 256 || len - headerSize != count * 3u)
+      {
+        _sendError(client, "bad_length", id);
+        return;
+      }
+      // Only used to decode later messages, so it takes effect right away
+      memcpy(_palette + start * 3, data + headerSize, count * 3);
+      // The ack goes through the queue, so in every ack mode it follows the
+      // acks of the commands sent before
+      if (command.flags & BIN_FLAG_NO_ACK)
+        return;
+      command.type = ACK_ONLY;
+      command.at = 0;
+      if (!enqueueCommand(command))
+        _sendAck(command.clientId, id);
+      return;
+    }
+    else if (opcode == BIN_SET_PIXELS || opcode == BIN_SET_INDEXED || opcode == BIN_SET_RLE || opcode == BIN_SET_DELTA)
+    {
+      uint16_t start = _readU16(data + 2);
+      uint16_t count = _readU16(data + 4);
+      uint32_t size = (uint32_t)count * 3;
+
+      if (count == 0 || (opcode == BIN_SET_PIXELS && len - headerSize != size))
+      {
+        _sendError(client, "bad_length", id);
+        return;
+      }
+      if ((uint32_t)start + count > strip.numPixels)
+      {
+        _sendIndexError(client, id, strip.numPixels);
+        return;
+      }
+      if (size >= _payloadCapacity)
+      {
+        _sendError(client, "payload_too_large", id);
+        return;
+      }
+
+      uint16_t offset;
+      if (!_reservePayload(size, offset))
+      {
+        _stats.queueFull++;
+        _sendError(client, "queue_full", id);
+        return;
+      }
+      // Everything is decoded to GRB here, so loop() stays a plain copy
+      if (!_decodeBinaryPixels(opcode, data + headerSize, len - headerSize, _payloadBuffer + offset, count))
+      {
+        _sendError(client, "bad_encoding", id);
+        return;
+      }
+
+      command.type = opcode == BIN_SET_DELTA ? XOR_PIXELS : SET_PIXELS;
+      command.index = strip.offset + start;
+      command.count = count;
+      command.payload = offset;
+
+      _enqueueWithPayload(client, command, size);
+      return;
+    }
+    else
+    {
+      _sendError(client, "unknown_opcode", id);
+      return;
+    }
+
+    if (!enqueueCommand(command))
+    {
+      _sendError(client, "queue_full", id);
+    }
+  }
+
+  // A complete text message. It is not NUL terminated, both parsers work on
+  // the given length.
+  void _onTextMessage(AsyncWebSocketClient *client, char *text, size_t len)
+  {
+    // Check for simple "ping" message (not JSON)
+    if (len == 4 && memcmp(text, "ping", 4) == 0)
+    {
+      NEOPIXEL_LOG_DEBUG("Received WebSocket ping from client #%u\n", client->id());
+      client->text("{\"status\":\"ok\",\"message\":\"pong\"}");
+      return;
+    }
+
+    // Fast path: scan the known fields straight out of the text
+    CommandFields fields;
+    uint32_t parseStart = micros();
+    bool scanned = CommandParser::scan(text, len, fields);
+    if (scanned)
+    {
+      _recordDuration(_stats.parseCount, _stats.parseTotalUs, _stats.parseMaxUs, micros() - parseStart);
+      if (_dispatchCommand(client, fields))
+        return;
+    }
+
+    // Everything else goes through ArduinoJson. It parses in place and
+    // rewrites the text, so the scanned fields are rebuilt from the document.
+    StaticJsonDocument<JSON_DOCUMENT_SIZE> doc;
+    parseStart = micros();
+    DeserializationError error = deserializeJson(doc, text, len);
+    _recordDuration(_stats.parseCount, _stats.parseTotalUs, _stats.parseMaxUs, micros() - parseStart);
+    if (error == DeserializationError::Ok)
+    {
+      fields = CommandFields();
+      CommandParser::fromDocument(doc, fields);
+      if (!scanned && _dispatchCommand(client, fields))
+        return;
+
+      uint32_t id = doc["id"] | 0; // Get command ID from client
+
+      if (id == 0)
+      {
+        // Command ID is required for non-ping commands
+        client->text("{\"status\":\"error\",\"error\":\"missing_id\"}");
+        return;
+      }
+
+      const char *cmd = doc["cmd"] | "";
+      if (strcmp(cmd, "startEffect") == 0)
+        _onStartEffect(client, doc, fields);
+      else if (strcmp(cmd, "stopEffect") == 0)
+        _onStopEffect(client, fields);
+      else if (strcmp(cmd, "saveScene") == 0)
+        _onScene(client, doc, fields, SAVE_SCENE);
+      else if (strcmp(cmd, "loadScene") == 0)
+        _onScene(client, doc, fields, LOAD_SCENE);
+      else if (strcmp(cmd, "deleteScene") == 0)
+        _onScene(client, doc, fields, DELETE_SCENE);
+      else
+        _sendError(client, "unknown_cmd", id);
+    }
+    else
+    {
+      _stats.badJson++;
+      client->text("{\"status\":\"error\",\"error\":\"bad_json\"}");
+    }
+  }
+
+  bool _push(SpscQueue<Command> &queue, const Command &cmd)
+  {
+    if (!_coalescing)
+      return queue.push(cmd);
+
+    uint8_t supersededCount = 0;
+    portENTER_CRITICAL(&_coalesceLock);
+    bool pushed = _coalesce(queue, cmd, supersededCount) || queue.push(cmd);
+    portEXIT_CRITICAL(&_coalesceLock);
+
+    _stats.coalesced += supersededCount;
+    return pushed;
+  }
+
+  // Commands nothing may be moved across or merged into
+  static bool _isBarrier(const Command &cmd)
+  {
+    return cmd.at != 0 || (cmd.flags & CMD_SEGMENT_MASK) || cmd.type == SHOW || (cmd.flags & BIN_FLAG_SHOW) ||
+           cmd.type == START_EFFECT || cmd.type == STOP_EFFECT || cmd.type == FADE_TO || cmd.type == FADE_TO_PIXELS ||
+           cmd.type == SAVE_SCENE || cmd.type == LOAD_SCENE || cmd.type == DELETE_SCENE;
+  }
+
+  // Runs under _coalesceLock, so it must not send anything, the acks of
+  // replaced commands are deferred. Returns true if cmd replaced a pending
+  // command, otherwise the caller pushes it.
+  bool _coalesce(SpscQueue<Command> &queue, const Command &cmd, uint8_t &supersededCount)
+  {
+    if (_isBarrier(cmd))
+      return false;
+
+    if ((cmd.type == SET_COLOR || cmd.type == CLEAR) && cmd.index == 0 && cmd.count == _numPixels)
+    {
+      // The fill overwrites all pixel writes queued right before it
+      uint8_t n = 0;
+      const Command *item;
+      while (n < COALESCE_WINDOW && (item = queue.pending(n)) != nullptr && item->clientId == cmd.clientId &&
+             !_isBarrier(*item) && (item->type == SET_PIXEL_COLOR || item->type == SET_COLOR || item->type == CLEAR) &&
+             _deferAck(*item))
+        n++;
+      queue.dropNewest(n);
+      supersededCount = n;
+      return false;
+    }
+
+    if (cmd.type != SET_PIXEL_COLOR && cmd.type != SET_BRIGHTNESS)
+      return false;
+
+    // Only the newest pending command is replaced. Replacing an older one
+    // would move cmd, and its ack, ahead of the ones queued after it.
+    Command *item = queue.pending(0);
+    if (item == nullptr || item->clientId != cmd.clientId || _isBarrier(*item) || item->type != cmd.type ||
+        (cmd.type == SET_PIXEL_COLOR && item->index != cmd.index))
+      return false;
+    if (!_deferAck(*item))
+      return false;
+    supersededCount = 1;
+    *item = cmd;
+    return true;
+  }
+
+  // Queues the ack of a replaced or dropped command, under _coalesceLock.
+  // With ACK_UP_TO the ack of the replacing command covers it. Returns false
+  // if there is no room, then the command must stay.
+  bool _deferAck(const Command &cmd)
+  {
+    if (_ackMode == ACK_UP_TO || cmd.clientId == 0 || (cmd.flags & BIN_FLAG_NO_ACK))
+      return true;
+    uint8_t count = _deferredAckCount.load(std::memory_order_relaxed);
+    if (count == DEFERRED_ACKS)
+      return false;
+    _deferredAcks[count].clientId = cmd.clientId;
+    _deferredAcks[count].commandId = cmd.commandId;
+    _deferredAckCount.store(count + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Slots are allocated on the first frame, by the producer
+  uint8_t *_frameSlotPixels()
+  {
+    if (_frameSlots[0].pixels == nullptr)
+    {
+      for (uint8_t i = 0; i < 3; ++i)
+        _frameSlots[i].pixels = new uint8_t[_numPixels * 3];
+      NEOPIXEL_LOG_INFO("Allocated %u bytes of frame slots\n", _numPixels * 9);
+    }
+    return _frameSlots[_writeFrame].pixels;
+  }
+
+  void _publishFrame(const Command &command)
+  {
+    _frameSlots[_writeFrame].command = command;
+    // Under the lock, so the ack of a dropped frame is deferred before
+    // loop() can take the new one
+    portENTER_CRITICAL(&_coalesceLock);
+    uint8_t previous = _readyFrame.exchange(_writeFrame | FRAME_FRESH, std::memory_order_acq_rel);
+    _writeFrame = previous & ~FRAME_FRESH;
+    bool deferred = !(previous & FRAME_FRESH) || _deferAck(_frameSlots[_writeFrame].command);
+    portEXIT_CRITICAL(&_coalesceLock);
+    if (previous & FRAME_FRESH)
+    {
+      // loop() never saw it
+      _stats.framesDropped++;
+      const Command &dropped = _frameSlots[_writeFrame].command;
+      if (!deferred)
+        _sendAck(dropped.clientId, dropped.commandId);
+    }
+  }
+
+  // Called by loop() after the queue, the frame replaces what the commands
+  // drawn in this pass
+  void _applyFrame()
+  {
+    if (!(_readyFrame.load(std::memory_order_relaxed) & FRAME_FRESH))
+      return;
+    portENTER_CRITICAL(&_coalesceLock);
+    uint8_t previous = _readyFrame.exchange(_readFrame, std::memory_order_acq_rel);
+    portEXIT_CRITICAL(&_coalesceLock);
+    _readFrame = previous & ~FRAME_FRESH;
+
+    const FrameSlot &slot = _frameSlots[_readFrame];
+    _stopEffects(0, _numPixels);
+    _stopTransitions(0, _numPixels);
+    _frame.write(0, _numPixels, slot.pixels);
+    _requestShow();
+    _acknowledge(slot.command);
+  }
+
+  void _allocateQueues()
+  {
+    if (_commandQueue.capacity() > 0)
+      return;
+    bool ok = _commandQueue.allocate(_queueConfig.commands, _queueConfig.psram);
+    for (uint8_t i = 0; i < CLIENT_QUEUES; ++i)
+      ok = _clientQueues[i].queue.allocate(_queueConfig.perClient, _queueConfig.psram) && ok;
+    // Without it bulk commands are answered with payload_too_large
+    _payloadBuffer = (uint8_t *)allocateStorage(_queueConfig.payload, _queueConfig.psram);
+    _payloadCapacity = _payloadBuffer ? _queueConfig.payload : 0;
+    ok = (_payloadBuffer != nullptr) && ok;
+    if (!ok)
+      NEOPIXEL_LOG_ERROR("Queue allocation failed\n");
+    NEOPIXEL_LOG_INFO("%u queue slots of %u bytes, %u bytes of queues, %u bytes object, %u bytes of pixels\n",
+                      queueCapacity(), (unsigned)sizeof(Command), (unsigned)queueBytes(),
+                      (unsigned)objectBytes(), (unsigned)frameBytes());
+  }
+
+  // Background part of begin(), called by loop()
+  void _updateWifi()
+  {
+    if (_wifiState != WIFI_STATE_CONNECTING)
+      return;
+    if (WiFi.status() == WL_CONNECTED)
+    {
+      _wifiState = WIFI_STATE_CONNECTED;
+      NEOPIXEL_LOG_INFO("Connected as STA. IP: %s\n", WiFi.localIP().toString().c_str());
+      _logEndpoints();
+    }
+    else if (millis() - _wifiStartMs >= _connectTimeoutMs)
+    {
+      _wifiState = WIFI_STATE_SOFTAP;
+      _startSoftAp();
+      _logEndpoints();
+    }
+  }
+
+  void _startSoftAp()
+  {
+    NEOPIXEL_LOG_INFO("STA connect failed after %u ms. Starting SoftAP with SSID '%s'\n",
+                      (unsigned)_connectTimeoutMs, _ssid);
+
+    if (_password != nullptr && strlen(_password) >= 8)
+    {
+      WiFi.mode(WIFI_AP_STA);
+      bool ok = WiFi.softAP(_ssid, _password);
+      if (!ok)
+      {
+        NEOPIXEL_LOG_WARN("softAP() returned false. Attempting open AP (no password).\n");
+        WiFi.softAP(_ssid);
+      }
+    }
+    else
+    {
+      NEOPIXEL_LOG_WARN("Password too short for WPA2; starting open AP.\n");
+      WiFi.mode(WIFI_AP);
+      WiFi.softAP(_ssid);
+    }
+
+    NEOPIXEL_LOG_INFO("SoftAP active. AP IP: %s\n", WiFi.softAPIP().toString().c_str());
+  }
+
+  void _logEndpoints()
+  {
+#if NEOPIXEL_LOG_LEVEL >= NEOPIXEL_LOG_LEVEL_INFO
+    IPAddress ip = (WiFi.getMode() & WIFI_AP) ? WiFi.softAPIP() : WiFi.localIP();
+    NEOPIXEL_LOG_INFO("WebSocket endpoint: ws://%s/ws\n", ip.toString().c_str());
+    NEOPIXEL_LOG_INFO("HTTP ping endpoint: http://%s/ping\n", ip.toString().c_str());
+#endif
+  }
+
+  // Names are echoed in JSON replies, so only printable ASCII without
+  // quotes and backslashes is allowed
+  static bool _validSceneName(const char *name, size_t len)
+  {
+    if (len == 0 || len >= SCENE_NAME_SIZE)
+      return false;
+    for (size_t i = 0; i < len; ++i)
+      if (name[i] < 0x20 || name[i] > 0x7e || name[i] == '"' || name[i] == '\\')
+        return false;
+    return true;
+  }
+
+  static bool _openScenes(Preferences &prefs, bool readOnly)
+  {
+    return prefs.begin("npcScenes", readOnly);
+  }
+
+  // Remembers the scene begin() restores, skips the flash write if it is
+  // already the one
+  void _setLastScene(const char *name)
+  {
+    Preferences prefs;
+    if (!prefs.begin("npcBoot"))
+      return;
+    char last[SCENE_NAME_SIZE];
+    if (prefs.getString("last", last, sizeof(last)) == 0 || strcmp(last, name) != 0)
+      prefs.putString("last", name);
+    prefs.end();
+  }
+
+  void _loadLastScene()
+  {
+    Preferences prefs;
+    char last[SCENE_NAME_SIZE];
+    bool found = prefs.begin("npcBoot", true) && prefs.getString("last", last, sizeof(last)) > 0;
+    prefs.end();
+    if (found && loadScene(last))
+      NEOPIXEL_LOG_INFO("Restored scene '%s'\n", last);
+  }
+
+  // Scene commands, the NUL terminated name is in the payload. Failures are
+  // answered with an error instead of the ack.
+  bool _executeScene(const Command &cmd)
+  {
+    const char *name = (const char *)(_payloadBuffer + cmd.payload);
+    bool ok = cmd.type == SAVE_SCENE ? saveScene(name) : cmd.type == LOAD_SCENE ? loadScene(name) : deleteScene(name);
+    if (!ok)
+    {
+      _sendError(cmd.clientId, cmd.type == SAVE_SCENE ? "storage_failed" : "unknown_scene", cmd.commandId);
+      _commandFailed = true;
+      return false;
+    }
+    if (cmd.flags & BIN_FLAG_SHOW)
+    {
+      _requestShow();
+      return true;
+    }
+    return false;
+  }
+
+  ClientQueue *_findClientQueue(uint32_t clientId)
+  {
+    if (clientId == 0)
+      return nullptr;
+    for (uint8_t i = 0; i < CLIENT_QUEUES; ++i)
+      if (_clientQueues[i].clientId == clientId)
+        return &_clientQueues[i];
+    return nullptr;
+  }
+
+  void _assignClientQueue(uint32_t clientId)
+  {
+    for (uint8_t i = 0; i < CLIENT_QUEUES; ++i)
+    {
+      ClientQueue &slot = _clientQueues[i];
+      if (slot.clientId == 0)
+      {
+        slot.clientId = clientId;
+        slot.bucket.tokens = _bucketSize();
+        slot.bucket.refilledMs = millis();
+        return;
+      }
+    }
+    NEOPIXEL_LOG_INFO("No free queue for client #%u, using the shared one\n", clientId);
+  }
+
+  uint32_t _bucketSize() const
+  {
+    uint16_t burst = _clientLimits.burst ? _clientLimits.burst : _clientLimits.commandsPerSecond;
+    return (uint32_t)burst * 1000;
+  }
+
+  // Token bucket refilled with commandsPerSecond tokens per second
+  bool _takeToken(uint32_t clientId)
+  {
+    if (_clientLimits.commandsPerSecond == 0)
+      return true;
+
+    ClientQueue *slot = _findClientQueue(clientId);
+    TokenBucket &bucket = slot ? slot->bucket : _sharedBucket;
+    uint32_t now = millis();
+    uint32_t elapsed = now - bucket.refilledMs;
+    if (elapsed > 0xffff)
+      elapsed = 0xffff;
+    bucket.refilledMs = now;
+    bucket.tokens += elapsed * _clientLimits.commandsPerSecond;
+    if (bucket.tokens > _bucketSize())
+      bucket.tokens = _bucketSize();
+
+    if (bucket.tokens < 1000)
+      return false;
+    bucket.tokens -= 1000;
+    return true;
+  }
+
+  void _onMessage(AsyncWebSocketClient *client, uint8_t opcode, uint8_t *data, size_t len)
+  {
+    _countClientMessage(client->id());
+    if (!_takeToken(client->id()))
+    {
+      _stats.rateLimited++;
+      client->text("{\"status\":\"error\",\"error\":\"rate_limited\"}");
+      return;
+    }
+    if (opcode == WS_BINARY)
+      _onBinaryMessage(client, data, len);
+    else if (opcode == WS_TEXT)
+      _onTextMessage(client, (char *)data, len);
+  }
+
+  // Messages that arrive in more than one piece (fragmented into several
+  // frames, or a frame split over several TCP packets) are collected in a
+  // reassembly buffer from a fixed pool, one per client while in progress.
+  void _onMessagePart(AsyncWebSocketClient *client, AwsFrameInfo *info, uint8_t *data, size_t len)
+  {
+    bool first = info->num == 0 && info->index == 0;
+    Reassembly *slot = _findReassembly(client->id());
+    if (first)
+    {
+      if (slot == nullptr)
+        slot = _findReassembly(0);
+      if (slot == nullptr)
+      {
+        _stats.reassemblyBusy++;
+        client->text("{\"status\":\"error\",\"error\":\"busy\"}");
+        return;
+      }
+      slot->clientId = client->id();
+      slot->opcode = info->opcode;
+      slot->size = 0;
+      slot->overflow = false;
+    }
+    else if (slot == nullptr)
+    {
+      // Start of the message was dropped
+      return;
+    }
+
+    if (slot->size + len > REASSEMBLY_BUFFER_SIZE)
+      slot->overflow = true;
+    else
+    {
+      memcpy(slot->buffer + slot->size, data, len);
+      slot->size += len;
+    }
+
+    if (info->final && info->index + len == info->len)
+    {
+      if (slot->overflow)
+        client->text("{\"status\":\"error\",\"error\":\"message_too_large\"}");
+      else
+        _onMessage(client, slot->opcode, slot->buffer, slot->size);
+      slot->clientId = 0;
+    }
+  }
+
+  Reassembly *_findReassembly(uint32_t clientId)
+  {
+    for (uint8_t i = 0; i < REASSEMBLY_SLOTS; ++i)
+      if (_reassembly[i].buffer && _reassembly[i].clientId == clientId)
+        return &_reassembly[i];
+    return nullptr;
+  }
+
+  inline void _onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client,
+                         AwsEventType type, void *arg, uint8_t *data, size_t len)
+  {
+    if (type == WS_EVT_CONNECT)
+    {
+      NEOPIXEL_LOG_INFO("WebSocket client #%u connected\n", client->id());
+      _assignClientQueue(client->id());
+    }
+    else if (type == WS_EVT_DISCONNECT)
+    {
+      NEOPIXEL_LOG_INFO("WebSocket client #%u disconnected\n", client->id());
+      _forgetClientStats(client->id());
+      ClientQueue *queue = _findClientQueue(client->id());
+      if (queue)
+        queue->clientId = 0;
+      Reassembly *slot = _findReassembly(client->id());
+      if (slot)
+        slot->clientId = 0;
+    }
+    else if (type == WS_EVT_DATA)
+    {
+      AwsFrameInfo *info = (AwsFrameInfo *)arg;
+      // Whole message in one piece, handled in place
+      if (info->final && info->num == 0 && info->index == 0 && info->len == len &&
+          _findReassembly(client->id()) == nullptr)
+        _onMessage(client, info->opcode, data, len);
+      else
+        _onMessagePart(client, info, data, len);
+    }
+  }
+};
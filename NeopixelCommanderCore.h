@@ -0,0 +1,595 @@
+#pragma once
+
+// Platform independent part of NeopixelCommander: the command format, the
+// queues, the output interface and the back buffer. It only needs the C++
+// standard library, so it also builds on a host, see extras/host.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+// Default number of pending commands, rounded up to a power of two. Can
+// also be set at runtime with QueueConfig.
+#ifndef COMMAND_QUEUE_SIZE
+#define COMMAND_QUEUE_SIZE 512
+#endif
+
+// Default size of each client queue, see QueueConfig
+#ifndef CLIENT_QUEUE_SIZE
+#define CLIENT_QUEUE_SIZE 64
+#endif
+
+// Default size in bytes of the buffer holding the pixel data of queued bulk
+// commands, see QueueConfig. At most 65535.
+#ifndef PAYLOAD_BUFFER_SIZE
+#define PAYLOAD_BUFFER_SIZE 8192
+#endif
+
+enum CommandType : uint8_t
+{
+  SET_PIXEL_COLOR,
+  SET_COLOR,
+  CLEAR,
+  SHOW,
+  SET_BRIGHTNESS,
+  SET_PIXELS,
+  START_EFFECT, // Effect parameters in the payload buffer
+  STOP_EFFECT,  // stops all effects overlapping index..index+count
+  FADE_TO,      // fades index..index+count to r, g, b over duration ms
+  FADE_TO_PIXELS, // fades index..index+count to the GRB bytes in the payload
+  XOR_PIXELS,     // XORs the payload into index..index+count
+  BLIT,           // GRB rectangle in the payload, index is its top left matrix cell
+  SAVE_SCENE,     // scene name in the payload
+  LOAD_SCENE,
+  DELETE_SCENE,
+  ACK_ONLY        // does nothing, acks an immediate command in queue order
+};
+
+enum EffectType
+{
+  EFFECT_NONE,
+  EFFECT_RAINBOW,  // hue cycle over the range, moving once per period
+  EFFECT_CHASE,    // size pixels of colors[0] running over colors[1]
+  EFFECT_FADE,     // breathing from colors[1] to colors[0] and back
+  EFFECT_NOISE,    // smooth value noise mapped onto the palette, size sets the grain
+  EFFECT_GRADIENT  // palette gradient scrolling once per period
+};
+
+// Binary WebSocket protocol (WS_BINARY frames, little endian):
+//
+//   offset 0  uint8   opcode     (BinaryOpcode)
+//   offset 1  uint8   flags      (BinaryFlags) in the low nibble, strip in the high nibble
+//   offset 2  uint16  start      first pixel index within the strip
+//   offset 4  uint16  count      number of pixels that follow
+//   offset 6  uint32  id         command ID, acked like JSON commands
+//   offset 10 uint8[] pixels     count * 3 bytes in G, R, B order
+//
+// With BIN_FLAG_AT a uint32 execution time (see syncedMillis()) sits at
+// offset 10 and the pixels start at offset 14.
+enum BinaryOpcode
+{
+  BIN_SET_PIXELS = 0x01,
+  BIN_SHOW = 0x02,
+  BIN_SET_FRAME = 0x03,      // all pixels of all strips, start 0 and count the total, implies show
+  BIN_SET_PALETTE = 0x04,    // count G, R, B entries of the palette from entry start on
+  BIN_SET_INDEXED = 0x05,    // count palette indices, one byte per pixel
+  BIN_SET_RLE = 0x06,        // runs of (length - 1, G, R, B), count pixels in total
+  BIN_SET_DELTA = 0x07,      // XOR against the current pixels, see _decodeDelta()
+  BIN_BLIT = 0x08,           // start and count are x and y, followed by uint16 width and height
+                             // and width * height pixels row by row, see setMatrix()
+  BIN_SNAPSHOT = 0x09        // sent to state observers: start is the downsample step, id the
+                             // frame number, see enableStatePush()
+};
+
+// Also stored in Command::flags for JSON commands
+enum BinaryFlags
+{
+  BIN_FLAG_SHOW = 0x01,   // show() right after the pixels were written
+  BIN_FLAG_NO_ACK = 0x02, // fire-and-forget, no ack is sent
+  BIN_FLAG_AT = 0x04,     // a uint32 execution time follows the header
+  BIN_FLAG_MASK = 0x0f,
+  CMD_SEGMENT_MASK = 0xf0 // Command::flags only: segment + 1 of a write to a mirrored segment
+};
+
+enum AckMode
+{
+  ACK_EACH,  // {"status":"ok","ack":id} per command
+  ACK_BATCH, // {"status":"ok","acks":[id,...]} per client and loop
+  ACK_UP_TO  // {"status":"ok","ackUpTo":id} with the last executed id per client and loop
+};
+
+static const size_t BINARY_HEADER_SIZE = 10;
+
+// Layout of a matrix built from panels of panelWidth x panelHeight pixels,
+// panelsX x panelsY of them chained row by row from the top left. Every
+// panel starts at its top left pixel, runs left to right and with
+// serpentine back on every other row. rotation is the number of quarter
+// turns clockwise the panels are mounted with.
+struct MatrixLayout
+{
+  explicit MatrixLayout(uint16_t panelWidth, uint16_t panelHeight, uint8_t panelsX = 1, uint8_t panelsY = 1,
+                        bool serpentine = true, uint8_t rotation = 0, uint16_t start = 0)
+      : panelWidth(panelWidth), panelHeight(panelHeight), panelsX(panelsX), panelsY(panelsY),
+        serpentine(serpentine), rotation(rotation), start(start) {}
+
+  uint16_t panelWidth; // as seen, after rotation
+  uint16_t panelHeight;
+  uint8_t panelsX;
+  uint8_t panelsY;
+  bool serpentine;
+  uint8_t rotation;
+  uint16_t start; // pixel index of the first panel's first pixel
+};
+
+// Token bucket applied to the messages of every WebSocket client
+struct ClientLimits
+{
+  explicit ClientLimits(uint16_t commandsPerSecond = 0, uint16_t burst = 0)
+      : commandsPerSecond(commandsPerSecond), burst(burst) {}
+
+  uint16_t commandsPerSecond; // 0 disables the limit
+  uint16_t burst;             // messages allowed at once, 0 for one second worth
+};
+
+// 24 bytes. Pixel commands carry their color, bulk commands a reference into
+// the payload buffer instead (anonymous structs are a GCC extension).
+struct Command
+{
+  CommandType type;
+  uint8_t flags;      // BinaryFlags
+  uint16_t index;
+  uint16_t count;     // SET_PIXELS: number of pixels in the payload, SET_COLOR/CLEAR: length of the range
+  uint16_t duration;  // FADE_TO: transition time in ms, BLIT: width of the rectangle
+  union
+  {
+    struct // SET_PIXEL_COLOR, SET_COLOR, SET_BRIGHTNESS, FADE_TO
+    {
+      uint8_t r;
+      uint8_t g;
+      uint8_t b;
+      uint8_t brightness;
+    };
+    struct // SET_PIXELS, FADE_TO_PIXELS, XOR_PIXELS, BLIT, START_EFFECT
+    {
+      uint16_t payload;       // offset of the data in the payload buffer
+      uint16_t payloadRecord; // releases the payload, see _releasePayload()
+    };
+  };
+  uint32_t at;        // execution time in syncedMillis(), 0 runs it when dequeued
+  uint32_t clientId;
+  uint32_t commandId; // unique ID for this command
+};
+
+static_assert(sizeof(Command) == 24, "Command layout changed, check the queue footprint");
+
+// Queue sizes, rounded up to powers of two, and the payload buffer size in
+// bytes. Storage is allocated by begin(), in PSRAM if psram is set and the
+// board has it.
+struct QueueConfig
+{
+  explicit QueueConfig(uint16_t commands = COMMAND_QUEUE_SIZE, uint16_t perClient = CLIENT_QUEUE_SIZE,
+                       bool psram = false, uint16_t payload = PAYLOAD_BUFFER_SIZE)
+      : commands(commands), perClient(perClient), psram(psram), payload(payload) {}
+
+  uint16_t commands;  // shared queue
+  uint16_t perClient; // each of the CLIENT_QUEUES client queues
+  bool psram;
+  uint16_t payload;   // pixel data of queued bulk commands, shared by all queues
+};
+
+// malloc() from PSRAM if asked for and the board has it, otherwise from
+// internal RAM. Release with free().
+inline void *allocateStorage(size_t bytes, bool psram)
+{
+  void *storage = nullptr;
+#ifdef ARDUINO
+  if (psram && psramFound())
+    storage = ps_malloc(bytes);
+#else
+  (void)psram;
+#endif
+  return storage ? storage : malloc(bytes);
+}
+
+// Lock-free single-producer/single-consumer ring buffer. push() must only be
+// called from one task (the AsyncTCP task) and pop() from one other task
+// (the one running loop()). The indices run freely and are masked on access,
+// so all slots are usable. T must be trivially copyable, the storage is raw
+// memory allocated by allocate().
+template <typename T>
+class SpscQueue
+{
+public:
+  ~SpscQueue() { free(_items); }
+
+  // Capacity is rounded up to a power of two, at most 32768. Must be called
+  // before the queue is used. Falls back to internal RAM if there is no PSRAM.
+  bool allocate(uint16_t capacity, bool psram)
+  {
+    uint16_t size = 2;
+    while (size < capacity && size < 32768)
+      size <<= 1;
+
+    free(_items);
+    _items = (T *)allocateStorage(size * sizeof(T), psram);
+    _capacity = _items ? size : 0;
+    _mask = _capacity - 1;
+    return _items != nullptr;
+  }
+  bool push(const T &item)
+  {
+    uint16_t head = _head.load(std::memory_order_relaxed);
+    uint16_t tail = _tail.load(std::memory_order_acquire);
+    uint16_t depth = head - tail;
+    if (depth >= _capacity)
+      return false;
+
+    _items[head & _mask] = item;
+    _head.store(head + 1, std::memory_order_release);
+
+    if (depth + 1 > _highWaterMark.load(std::memory_order_relaxed))
+      _highWaterMark.store(depth + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  bool pop(T &item)
+  {
+    uint16_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail == _head.load(std::memory_order_acquire))
+      return false;
+
+    item = _items[tail & _mask];
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const
+  {
+    return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+  }
+
+  uint16_t depth() const
+  {
+    return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+  }
+
+  uint16_t highWaterMark() const { return _highWaterMark.load(std::memory_order_relaxed); }
+  void resetHighWaterMark() { _highWaterMark.store(depth(), std::memory_order_relaxed); }
+
+  uint16_t capacity() const { return _capacity; }
+  size_t bytes() const { return (size_t)_capacity * sizeof(T); }
+
+  // Producer side access to pending items, back 0 is the newest one. Only
+  // safe while pop() is kept out by a lock shared with the consumer.
+  T *pending(uint16_t back)
+  {
+    uint16_t head = _head.load(std::memory_order_relaxed);
+    if ((uint16_t)(head - _tail.load(std::memory_order_acquire)) <= back)
+      return nullptr;
+    return &_items[(uint16_t)(head - 1 - back) & _mask];
+  }
+
+  // Takes back the newest n pending items, same locking as pending()
+  void dropNewest(uint16_t n)
+  {
+    _head.store(_head.load(std::memory_order_relaxed) - n, std::memory_order_release);
+  }
+
+private:
+  T *_items = nullptr;
+  uint16_t _capacity = 0;
+  uint16_t _mask = 0;
+  std::atomic<uint16_t> _head{0}; // written by the producer only
+  std::atomic<uint16_t> _tail{0}; // written by the consumer only
+  std::atomic<uint16_t> _highWaterMark{0};
+};
+
+// Binary min-heap ordering items by their `at` time, owned by a single task.
+// Items due at the same time keep their insertion order. Times are compared
+// with wraparound and must be less than 2^31 ms apart.
+template <typename T, uint16_t Size>
+class ScheduleQueue
+{
+public:
+  bool push(const T &item)
+  {
+    if (_size == Size)
+      return false;
+
+    Entry entry = {item, _sequence++};
+    uint16_t i = _size++;
+    while (i > 0)
+    {
+      uint16_t parent = (i - 1) / 2;
+      if (!_before(entry, _entries[parent]))
+        break;
+      _entries[i] = _entries[parent];
+      i = parent;
+    }
+    _entries[i] = entry;
+    return true;
+  }
+
+  // Pops the earliest item if it is due at now
+  bool popDue(uint32_t now, T &item)
+  {
+    if (_size == 0 || (int32_t)(_entries[0].item.at - now) > 0)
+      return false;
+
+    item = _entries[0].item;
+    Entry last = _entries[--_size];
+    uint16_t i = 0;
+    for (;;)
+    {
+      uint16_t child = 2 * i + 1;
+      if (child >= _size)
+        break;
+      if (child + 1 < _size && _before(_entries[child + 1], _entries[child]))
+        child++;
+      if (!_before(_entries[child], last))
+        break;
+      _entries[i] = _entries[child];
+      i = child;
+    }
+    _entries[i] = last;
+    return true;
+  }
+
+  uint16_t size() const { return _size; }
+
+  // Items in heap order, not in time order
+  const T &operator[](uint16_t i) const { return _entries[i].item; }
+
+  static constexpr uint16_t capacity() { return Size; }
+
+private:
+  struct Entry
+  {
+    T item;
+    uint32_t sequence;
+  };
+
+  static bool _before(const Entry &a, const Entry &b)
+  {
+    int32_t difference = a.item.at - b.item.at;
+    return difference < 0 || (difference == 0 && (int32_t)(a.sequence - b.sequence) < 0);
+  }
+
+  Entry _entries[Size];
+  uint16_t _size = 0;
+  uint32_t _sequence = 0;
+};
+
+// Destination of the rendered frame. NeopixelCommander copies the back buffer
+// into pixels() and calls show(). Implementations may send asynchronously; in
+// that case pixels() must not be written again until waitDone() returned.
+class NeopixelOutput
+{
+public:
+  typedef void (*ShowCompleteCallback)(void *arg);
+
+  virtual ~NeopixelOutput() {}
+
+  virtual bool begin(uint8_t pin, uint16_t numPixels) = 0;
+
+  // numPixels * 3 bytes in G, R, B order
+  virtual uint8_t *pixels() = 0;
+
+  // Starts sending pixels() to the LEDs
+  virtual void show() = 0;
+
+  // Like show(), but only pixels first..first+count changed since the last
+  // one. Outputs that can do partial updates override it.
+  virtual void showRange(uint16_t first, uint16_t count)
+  {
+    (void)first;
+    (void)count;
+    show();
+  }
+
+  // True while a transfer (including the latch time) is still running
+  virtual bool busy() { return false; }
+
+  // Blocks until the previous transfer has finished
+  virtual void waitDone() {}
+
+  // Called when a transfer has finished. For asynchronous outputs this runs
+  // in interrupt context.
+  void onShowComplete(ShowCompleteCallback callback, void *arg)
+  {
+    _callbackArg = arg;
+    _callback = callback;
+  }
+
+protected:
+  void _showComplete()
+  {
+    if (_callback)
+      _callback(_callbackArg);
+  }
+
+private:
+  ShowCompleteCallback _callback = nullptr;
+  void *_callbackArg = nullptr;
+};
+
+// Back buffer in G, R, B order, the layout of the binary protocol. Commands
+// only ever write here and the range they touched is tracked, so a show can
+// skip unchanged pixels and never catches a half-applied update.
+class PixelBuffer
+{
+public:
+  ~PixelBuffer() { delete[] _pixels; }
+
+  // Keeps the current pixels, added ones are black. All pixels are dirty
+  // afterwards.
+  void resize(uint16_t size)
+  {
+    uint8_t *pixels = new uint8_t[size * 3]();
+    if (_pixels)
+      memcpy(pixels, _pixels, (_size < size ? _size : size) * 3);
+    delete[] _pixels;
+    _pixels = pixels;
+    _size = size;
+    markDirty(0, size);
+  }
+
+  uint8_t *data() { return _pixels; }
+  const uint8_t *data() const { return _pixels; }
+  uint16_t size() const { return _size; }
+
+  void set(uint16_t n, uint8_t r, uint8_t g, uint8_t b)
+  {
+    uint8_t *p = _pixels + n * 3;
+    p[0] = g;
+    p[1] = r;
+    p[2] = b;
+    markDirty(n, 1);
+  }
+
+  void write(uint16_t start, uint16_t count, const uint8_t *grb)
+  {
+    memcpy(_pixels + start * 3, grb, count * 3);
+    markDirty(start, count);
+  }
+
+  void fill(uint16_t start, uint16_t count, uint8_t r, uint8_t g, uint8_t b)
+  {
+    uint8_t *p = _pixels + start * 3;
+    for (uint16_t i = 0; i < count; ++i, p += 3)
+    {
+      p[0] = g;
+      p[1] = r;
+      p[2] = b;
+    }
+    markDirty(start, count);
+  }
+
+  void clear(uint16_t start, uint16_t count)
+  {
+    memset(_pixels + start * 3, 0, count * 3);
+    markDirty(start, count);
+  }
+
+  // Only the pixels that actually changed are marked dirty
+  void applyXor(uint16_t start, uint16_t count, const uint8_t *delta)
+  {
+    uint8_t *p = _pixels + start * 3;
+    size_t size = count * 3;
+    size_t first = size, last = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+      if (delta[i] == 0)
+        continue;
+      p[i] ^= delta[i];
+      if (first == size)
+        first = i;
+      last = i;
+    }
+    if (first < size)
+      markDirty(start + first / 3, last / 3 - first / 3 + 1);
+  }
+
+  // Grows the range of pixels that changed since the last clean()
+  void markDirty(uint16_t first, uint16_t count)
+  {
+    if (count == 0)
+      return;
+    if (_dirtyFirst >= _dirtyEnd)
+    {
+      _dirtyFirst = first;
+      _dirtyEnd = first + count;
+      return;
+    }
+    if (first < _dirtyFirst)
+      _dirtyFirst = first;
+    if (first + count > _dirtyEnd)
+      _dirtyEnd = first + count;
+  }
+
+  bool dirty() const { return _dirtyFirst < _dirtyEnd; }
+  uint16_t dirtyFirst() const { return _dirtyFirst; }
+  uint16_t dirtyEnd() const { return _dirtyEnd; }
+  void clean() { _dirtyFirst = _dirtyEnd = 0; }
+
+private:
+  uint8_t *_pixels = nullptr;
+  uint16_t _size = 0;
+  // Pixels changed since the last clean(), empty if _dirtyFirst >= _dirtyEnd
+  uint16_t _dirtyFirst = 0;
+  uint16_t _dirtyEnd = 0;
+};
+
+// Brightness, white balance and gamma folded into one table per channel
+// (R, G, B), applied in a single pass while a frame is copied to an output.
+// This keeps the back buffer at full precision.
+class ColorLut
+{
+public:
+  // 255 leaves a channel unchanged, gamma applies a fixed 2.6 curve
+  void build(uint8_t brightness, bool gamma, const uint8_t whiteBalance[3])
+  {
+    const uint8_t *curve = _gammaTable();
+    _identity = !gamma && brightness == 255 &&
+                whiteBalance[0] == 255 && whiteBalance[1] == 255 && whiteBalance[2] == 255;
+    for (uint8_t c = 0; c < 3; ++c)
+    {
+      uint32_t scale = (uint32_t)(brightness + 1) * (whiteBalance[c] + 1);
+      for (uint16_t v = 0; v < 256; ++v)
+        _table[c][v] = ((gamma ? curve[v] : v) * scale) >> 16;
+    }
+  }
+
+  bool identity() const { return _identity; }
+
+  // Copies count G, R, B pixels to out, where red, green and blue go to the
+  // byte offsets in rgbOffsets
+  void apply(uint8_t *out, const uint8_t *in, uint16_t count, const uint8_t rgbOffsets[3]) const
+  {
+    if (_identity && rgbOffsets[0] == 1 && rgbOffsets[1] == 0 && rgbOffsets[2] == 2)
+    {
+      memcpy(out, in, count * 3);
+      return;
+    }
+    // One lookup per channel, written in wire order
+    for (uint16_t n = 0; n < count; ++n, in += 3, out += 3)
+    {
+      out[rgbOffsets[0]] = _table[0][in[1]];
+      out[rgbOffsets[1]] = _table[1][in[0]];
+      out[rgbOffsets[2]] = _table[2][in[2]];
+    }
+  }
+
+private:
+  static const uint8_t *_gammaTable()
+  {
+    // round(255 * (i / 255) ^ 2.6)
+    static const uint8_t table[256] = {
+        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+        0,   0,   0,   0,   0,   0,   0,   0,   1,   1,   1,   1,   1,   1,   1,   1,
+        1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,   2,   3,   3,   3,   3,
+        3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   5,   6,   6,   6,   6,   7,
+        7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  10,  11,  11,  11,  12,  12,
+       13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,  20,
+       20,  21,  21,  22,  22,  23,  24,  24,  25,  25,  26,  27,  27,  28,  29,  29,
+       30,  31,  31,  32,  33,  34,  34,  35,  36,  37,  38,  38,  39,  40,  41,  42,
+       42,  43,  44,  45,  46,  47,  48,  49,  50,  51,  52,  53,  54,  55,  56,  57,
+       58,  59,  60,  61,  62,  63,  64,  65,  66,  68,  69,  70,  71,  72,  73,  75,
+       76,  77,  78,  80,  81,  82,  84,  85,  86,  88,  89,  90,  92,  93,  94,  96,
+       97,  99, 100, 102, 103, 105, 106, 108, 109, 111, 112, 114, 115, 117, 119, 120,
+      122, 124, 125, 127, 129, 130, 132, 134, 136, 137, 139, 141, 143, 145, 146, 148,
+      150, 152, 154, 156, 158, 160, 162, 164, 166, 168, 170, 172, 174, 176, 178, 180,
+      182, 184, 186, 188, 191, 193, 195, 197, 199, 202, 204, 206, 209, 211, 213, 215,
+      218, 220, 223, 225, 227, 230, 232, 235, 237, 240, 242, 245, 247, 250, 252, 255};
+    return table;
+  }
+
+  uint8_t _table[3][256];
+  bool _identity = true;
+};
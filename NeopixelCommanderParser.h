@@ -0,0 +1,604 @@
+#pragma once
+
+// JSON command parser of NeopixelCommander. Turns a message into
+// CommandFields, either with the single pass scanner or through an ArduinoJson
+// document, and the fields into a Command. Needs nothing but ArduinoJson and
+// the core header, so it also builds on a host.
+
+#include <stdint.h>
+#include <string.h>
+#include <ArduinoJson.h>
+
+#include "NeopixelCommanderCore.h"
+
+// Known fields of a JSON command. Filled either by CommandParser::scan()
+// straight from the message text, or from an ArduinoJson document as fallback.
+// Defaults match what the `doc["x"] | default` lookups used to return.
+struct CommandFields
+{
+  const char *cmd = "";
+  size_t cmdLength = 0;
+  uint32_t id = 0;
+  int32_t strip = -1;
+  int32_t segment = -1;
+  const char *segmentName = nullptr; // "segment" given as a name
+  size_t segmentNameLength = 0;
+  int32_t index = 0;
+  int32_t r = 0;
+  int32_t g = 0;
+  int32_t b = 0;
+  int32_t brightness = 255;
+  int32_t start = 0;
+  int32_t count = 0;
+  int32_t duration = 0;
+  uint32_t at = 0;
+  uint32_t time = 0;
+  bool hasTime = false;
+  bool show = false;
+  bool noAck = false;
+  bool hasColor = false; // "color" was given and parsed into color
+  bool badColor = false; // "color" was given but is not a color
+  uint32_t color = 0;
+  const char *hex = nullptr;
+  size_t hexLength = 0;
+  const char *colors = nullptr; // raw "[...]" text, set by scan()
+  size_t colorsLength = 0;
+  JsonArrayConst colorsArray;   // set by the ArduinoJson fallback
+};
+
+enum JsonCommand
+{
+  JSON_UNKNOWN,
+  JSON_PING,
+  JSON_GET_STATS,
+  JSON_GET_PIXEL_COUNT,
+  JSON_SET_COLOR,
+  JSON_CLEAR,
+  JSON_SET_PIXEL_COLOR,
+  JSON_SET_PIXELS,
+  JSON_FILL_RANGE,
+  JSON_SHOW,
+  JSON_SET_BRIGHTNESS,
+  JSON_FADE_TO,
+  JSON_GET_TIME,
+  JSON_SYNC_TIME,
+  JSON_SET_FRAME
+};
+
+// The pixels a command is addressed to, resolved by the caller from "strip"
+// or "segment". Indices are checked against length, a fill of the whole
+// target covers span pixels (twice length for mirrored segments).
+struct CommandTarget
+{
+  uint16_t first;
+  uint16_t length;
+  uint16_t span;
+};
+
+enum CommandStatus
+{
+  COMMAND_OK,
+  COMMAND_UNHANDLED, // not a simple command, left to the caller
+  COMMAND_BAD_INDEX,
+  COMMAND_BAD_COLOR
+};
+
+class CommandParser
+{
+private:
+  // FNV-1a, used to switch over command and field names. Every case still
+  // compares the full name, so collisions only cost a memcmp.
+  static constexpr uint32_t _nameHash(const char *name, uint32_t hash = 2166136261u)
+  {
+    return *name ? _nameHash(name + 1, (hash ^ (uint8_t)*name) * 16777619u) : hash;
+  }
+
+  static uint32_t _hashKey(const char *key, size_t len)
+  {
+    uint32_t hash = 2166136261u;
+    while (len--)
+      hash = (hash ^ (uint8_t)*key++) * 16777619u;
+    return hash;
+  }
+
+  static const char *_skipWhitespace(const char *p, const char *end)
+  {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+      ++p;
+    return p;
+  }
+
+  // p points at the opening quote. Strings with escapes are left to
+  // ArduinoJson.
+  static const char *_scanString(const char *p, const char *end, const char *&str, size_t &len)
+  {
+    const char *s = ++p;
+    while (p < end && *p != '"')
+    {
+      if (*p == '\\')
+        return nullptr;
+      ++p;
+    }
+    if (p == end)
+      return nullptr;
+    str = s;
+    len = p - s;
+    return p + 1;
+  }
+
+  // Integers only, fractions and exponents are left to ArduinoJson
+  static const char *_scanInteger(const char *p, const char *end, int64_t &value)
+  {
+    bool negative = p < end && *p == '-';
+    if (negative)
+      ++p;
+    const char *digits = p;
+    uint64_t v = 0;
+    while (p < end && *p >= '0' && *p <= '9' && p - digits < 12)
+      v = v * 10 + (*p++ - '0');
+    if (p == digits || (p < end && (*p == '.' || *p == 'e' || *p == 'E' || (*p >= '0' && *p <= '9'))))
+      return nullptr;
+    value = negative ? -(int64_t)v : (int64_t)v;
+    return p;
+  }
+
+  static const char *_scanInt32(const char *p, const char *end, int32_t &value)
+  {
+    int64_t v;
+    p = _scanInteger(p, end, v);
+    if (p == nullptr || v < INT32_MIN || v > INT32_MAX)
+      return nullptr;
+    value = v;
+    return p;
+  }
+
+  static const char *_scanBool(const char *p, const char *end, bool &value)
+  {
+    if (end - p >= 4 && memcmp(p, "true", 4) == 0)
+    {
+      value = true;
+      return p + 4;
+    }
+    if (end - p >= 5 && memcmp(p, "false", 5) == 0)
+    {
+      value = false;
+      return p + 5;
+    }
+    return nullptr;
+  }
+
+  // Skips any JSON value without interpreting it
+  static const char *_skipValue(const char *p, const char *end)
+  {
+    int depth = 0;
+    do
+    {
+      p = _skipWhitespace(p, end);
+      if (p == end)
+        return nullptr;
+      char c = *p;
+      if (c == '"')
+      {
+        for (++p; p < end && *p != '"'; ++p)
+          if (*p == '\\')
+            ++p;
+        if (p >= end)
+          return nullptr;
+        ++p;
+      }
+      else if (c == '{' || c == '[')
+      {
+        ++depth;
+        ++p;
+      }
+      else if (c == '}' || c == ']')
+      {
+        if (depth == 0)
+          return nullptr;
+        --depth;
+        ++p;
+      }
+      else if (c == ',' || c == ':')
+      {
+        if (depth == 0)
+          return nullptr;
+        ++p;
+      }
+      else
+      {
+        const char *s = p;
+        while (p < end && (isalnum((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.'))
+          ++p;
+        if (p == s)
+          return nullptr;
+      }
+    } while (depth > 0);
+    return p;
+  }
+
+  static const char *_scanField(const char *key, size_t keyLength, const char *p, const char *end,
+                                CommandFields &f)
+  {
+    int64_t value;
+    switch (_hashKey(key, keyLength))
+    {
+    case _nameHash("cmd"):
+      if (!keyIs(key, keyLength, "cmd"))
+        break;
+      return *p == '"' ? _scanString(p, end, f.cmd, f.cmdLength) : nullptr;
+    case _nameHash("id"):
+      if (!keyIs(key, keyLength, "id"))
+        break;
+      p = _scanInteger(p, end, value);
+      if (p == nullptr || value < 0 || value > UINT32_MAX)
+        return nullptr;
+      f.id = value;
+      return p;
+    case _nameHash("at"):
+      if (!keyIs(key, keyLength, "at"))
+        break;
+      p = _scanInteger(p, end, value);
+      if (p == nullptr || value < 0 || value > UINT32_MAX)
+        return nullptr;
+      f.at = value;
+      return p;
+    case _nameHash("time"):
+      if (!keyIs(key, keyLength, "time"))
+        break;
+      p = _scanInteger(p, end, value);
+      if (p == nullptr || value < 0 || value > UINT32_MAX)
+        return nullptr;
+      f.time = value;
+      f.hasTime = true;
+      return p;
+    case _nameHash("index"):
+      if (!keyIs(key, keyLength, "index"))
+        break;
+      return _scanInt32(p, end, f.index);
+    case _nameHash("r"):
+      if (!keyIs(key, keyLength, "r"))
+        break;
+      return _scanInt32(p, end, f.r);
+    case _nameHash("g"):
+      if (!keyIs(key, keyLength, "g"))
+        break;
+      return _scanInt32(p, end, f.g);
+    case _nameHash("b"):
+      if (!keyIs(key, keyLength, "b"))
+        break;
+      return _scanInt32(p, end, f.b);
+    case _nameHash("brightness"):
+      if (!keyIs(key, keyLength, "brightness"))
+        break;
+      return _scanInt32(p, end, f.brightness);
+    case _nameHash("strip"):
+      if (!keyIs(key, keyLength, "strip"))
+        break;
+      return _scanInt32(p, end, f.strip);
+    case _nameHash("segment"):
+      if (!keyIs(key, keyLength, "segment"))
+        break;
+      if (*p == '"')
+        return _scanString(p, end, f.segmentName, f.segmentNameLength);
+      return _scanInt32(p, end, f.segment);
+    case _nameHash("start"):
+      if (!keyIs(key, keyLength, "start"))
+        break;
+      return _scanInt32(p, end, f.start);
+    case _nameHash("count"):
+      if (!keyIs(key, keyLength, "count"))
+        break;
+      return _scanInt32(p, end, f.count);
+    case _nameHash("duration"):
+      if (!keyIs(key, keyLength, "duration"))
+        break;
+      return _scanInt32(p, end, f.duration);
+    case _nameHash("show"):
+      if (!keyIs(key, keyLength, "show"))
+        break;
+      return _scanBool(p, end, f.show);
+    case _nameHash("noAck"):
+      if (!keyIs(key, keyLength, "noAck"))
+        break;
+      return _scanBool(p, end, f.noAck);
+    case _nameHash("hex"):
+      if (!keyIs(key, keyLength, "hex"))
+        break;
+      return *p == '"' ? _scanString(p, end, f.hex, f.hexLength) : nullptr;
+    case _nameHash("color"):
+      if (!keyIs(key, keyLength, "color"))
+        break;
+      if (*p == '"')
+      {
+        const char *hex;
+        size_t hexLength;
+        p = _scanString(p, end, hex, hexLength);
+        if (p == nullptr)
+          return nullptr;
+        f.hasColor = parseHexColor(hex, hexLength, f.color);
+        f.badColor = !f.hasColor;
+        return p;
+      }
+      p = _scanInteger(p, end, value);
+      if (p == nullptr)
+        return nullptr;
+      f.hasColor = value >= 0 && value <= 0xffffff;
+      f.badColor = !f.hasColor;
+      f.color = f.hasColor ? value : 0;
+      return p;
+    case _nameHash("colors"):
+      if (!keyIs(key, keyLength, "colors"))
+        break;
+      if (*p != '[')
+        return nullptr;
+      f.colors = p;
+      p = _skipValue(p, end);
+      if (p != nullptr)
+        f.colorsLength = p - f.colors;
+      return p;
+    }
+    // Fields of other commands are picked up by the fallback
+    return _skipValue(p, end);
+  }
+
+
+  static int _hexValue(char c)
+  {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+    return -1;
+  }
+
+public:
+  static void packGrb(uint8_t *out, uint32_t color)
+  {
+    out[0] = color >> 8;
+    out[1] = color >> 16;
+    out[2] = color;
+  }
+
+  // Parses "RRGGBB" (optionally prefixed with '#') into a packed color
+  static bool parseHexColor(const char *hex, size_t len, uint32_t &color)
+  {
+    if (len == 7 && hex[0] == '#')
+    {
+      hex++;
+      len--;
+    }
+    if (len != 6)
+      return false;
+    color = 0;
+    for (uint8_t i = 0; i < 6; ++i)
+    {
+      int v = _hexValue(hex[i]);
+      if (v < 0)
+        return false;
+      color = (color << 4) | v;
+    }
+    return true;
+  }
+
+  static bool keyIs(const char *key, size_t len, const char *name)
+  {
+    return strlen(name) == len && memcmp(key, name, len) == 0;
+  }
+
+  static JsonCommand lookup(const char *name, size_t len)
+  {
+    switch (_hashKey(name, len))
+    {
+    case _nameHash("setPixelColor"):
+      return keyIs(name, len, "setPixelColor") ? JSON_SET_PIXEL_COLOR : JSON_UNKNOWN;
+    case _nameHash("setPixels"):
+      return keyIs(name, len, "setPixels") ? JSON_SET_PIXELS : JSON_UNKNOWN;
+    case _nameHash("setFrame"):
+      return keyIs(name, len, "setFrame") ? JSON_SET_FRAME : JSON_UNKNOWN;
+    case _nameHash("fillRange"):
+      return keyIs(name, len, "fillRange") ? JSON_FILL_RANGE : JSON_UNKNOWN;
+    case _nameHash("show"):
+      return keyIs(name, len, "show") ? JSON_SHOW : JSON_UNKNOWN;
+    case _nameHash("setColor"):
+      return keyIs(name, len, "setColor") ? JSON_SET_COLOR : JSON_UNKNOWN;
+    case _nameHash("clear"):
+      return keyIs(name, len, "clear") ? JSON_CLEAR : JSON_UNKNOWN;
+    case _nameHash("setBrightness"):
+      return keyIs(name, len, "setBrightness") ? JSON_SET_BRIGHTNESS : JSON_UNKNOWN;
+    case _nameHash("fadeTo"):
+      return keyIs(name, len, "fadeTo") ? JSON_FADE_TO : JSON_UNKNOWN;
+    case _nameHash("transition"):
+      return keyIs(name, len, "transition") ? JSON_FADE_TO : JSON_UNKNOWN;
+    case _nameHash("getTime"):
+      return keyIs(name, len, "getTime") ? JSON_GET_TIME : JSON_UNKNOWN;
+    case _nameHash("syncTime"):
+      return keyIs(name, len, "syncTime") ? JSON_SYNC_TIME : JSON_UNKNOWN;
+    case _nameHash("ping"):
+      return keyIs(name, len, "ping") ? JSON_PING : JSON_UNKNOWN;
+    case _nameHash("getStats"):
+      return keyIs(name, len, "getStats") ? JSON_GET_STATS : JSON_UNKNOWN;
+    case _nameHash("getPixelCount"):
+      return keyIs(name, len, "getPixelCount") ? JSON_GET_PIXEL_COUNT : JSON_UNKNOWN;
+    default:
+      return JSON_UNKNOWN;
+    }
+  }
+
+  // Single pass parser for flat command objects such as
+  // {"cmd":"setPixelColor","id":7,"index":2,"r":255,"g":0,"b":0}. It knows
+  // the fields of the hot path commands and skips all others. Anything it
+  // does not understand (escapes, fractions, wrong types) makes it fail and
+  // the message goes through ArduinoJson instead.
+  static bool scan(const char *p, size_t size, CommandFields &f)
+  {
+    const char *end = p + size;
+    p = _skipWhitespace(p, end);
+    if (p == end || *p != '{')
+      return false;
+    p = _skipWhitespace(p + 1, end);
+    if (p < end && *p == '}')
+      return _skipWhitespace(p + 1, end) == end;
+
+    for (;;)
+    {
+      const char *key;
+      size_t keyLength;
+      if (p == end || *p != '"' || (p = _scanString(p, end, key, keyLength)) == nullptr)
+        return false;
+      p = _skipWhitespace(p, end);
+      if (p == end || *p != ':')
+        return false;
+      p = _skipWhitespace(p + 1, end);
+      if (p == end || (p = _scanField(key, keyLength, p, end, f)) == nullptr)
+        return false;
+      p = _skipWhitespace(p, end);
+      if (p == end)
+        return false;
+      if (*p == '}')
+        return _skipWhitespace(p + 1, end) == end;
+      if (*p != ',')
+        return false;
+      p = _skipWhitespace(p + 1, end);
+    }
+  }
+
+  static void fromDocument(const JsonDocument &doc, CommandFields &f)
+  {
+    f.cmd = doc["cmd"] | "";
+    f.cmdLength = strlen(f.cmd);
+    f.id = doc["id"] | 0;
+    f.strip = doc["strip"] | -1;
+    f.segment = doc["segment"] | -1;
+    f.segmentName = doc["segment"] | (const char *)nullptr;
+    f.segmentNameLength = f.segmentName ? strlen(f.segmentName) : 0;
+    f.index = doc["index"] | 0;
+    f.r = doc["r"] | 0;
+    f.g = doc["g"] | 0;
+    f.b = doc["b"] | 0;
+    f.brightness = doc["brightness"] | 255;
+    f.start = doc["start"] | 0;
+    f.count = doc["count"] | 0;
+    f.duration = doc["duration"] | 0;
+    f.at = doc["at"] | 0u;
+    f.hasTime = doc["time"].is<uint32_t>();
+    f.time = doc["time"] | 0u;
+    f.show = doc["show"] | false;
+    f.noAck = doc["noAck"] | false;
+    f.hex = doc["hex"] | (const char *)nullptr;
+    f.hexLength = f.hex ? strlen(f.hex) : 0;
+    f.colorsArray = doc["colors"].as<JsonArrayConst>();
+
+    JsonVariantConst color = doc["color"];
+    if (color.is<const char *>())
+    {
+      const char *hex = color.as<const char *>();
+      f.hasColor = parseHexColor(hex, strlen(hex), f.color);
+      f.badColor = !f.hasColor;
+    }
+    else if (!color.isNull())
+    {
+      f.hasColor = color.is<uint32_t>() && color.as<uint32_t>() <= 0xffffff;
+      f.badColor = !f.hasColor;
+      f.color = f.hasColor ? color.as<uint32_t>() : 0;
+    }
+  }
+
+  // True if start..start+count lies within length pixels. start + count
+  // could overflow, so count is compared against what is left after start.
+  static bool rangeFits(int32_t start, int32_t count, uint16_t length)
+  {
+    return start >= 0 && count >= 0 && start <= length && count <= length - start;
+  }
+
+  // Fills command from the fields of the commands that need no payload:
+  // setColor, clear, setPixelColor, fillRange, show and setBrightness. The
+  // id, "at" and "noAck" are set for every command, also when it returns
+  // COMMAND_UNHANDLED. Segment mapping is left to the caller.
+  static CommandStatus toCommand(JsonCommand name, const CommandFields &fields, const CommandTarget &target,
+                                 Command &command)
+  {
+    command.commandId = fields.id;
+    command.flags = fields.noAck ? BIN_FLAG_NO_ACK : 0;
+    command.at = fields.at;
+
+    switch (name)
+    {
+    case JSON_SET_COLOR:
+      command.type = SET_COLOR;
+      command.index = target.first;
+      command.count = target.span;
+      command.r = fields.r;
+      command.g = fields.g;
+      command.b = fields.b;
+      return COMMAND_OK;
+    case JSON_CLEAR:
+      command.type = CLEAR;
+      command.index = target.first;
+      command.count = target.span;
+      return COMMAND_OK;
+    case JSON_SET_PIXEL_COLOR:
+      if (fields.index < 0 || fields.index >= target.length)
+        return COMMAND_BAD_INDEX;
+      command.type = SET_PIXEL_COLOR;
+      command.index = target.first + fields.index;
+      command.r = fields.r;
+      command.g = fields.g;
+      command.b = fields.b;
+      return COMMAND_OK;
+    case JSON_FILL_RANGE:
+      // A ranged SET_COLOR
+      if (fields.count <= 0 || !rangeFits(fields.start, fields.count, target.length))
+        return COMMAND_BAD_INDEX;
+      if (fields.badColor)
+        return COMMAND_BAD_COLOR;
+      command.type = SET_COLOR;
+      command.index = target.first + fields.start;
+      command.count = fields.count;
+      command.r = fields.hasColor ? (uint8_t)(fields.color >> 16) : fields.r;
+      command.g = fields.hasColor ? (uint8_t)(fields.color >> 8) : fields.g;
+      command.b = fields.hasColor ? (uint8_t)fields.color : fields.b;
+      return COMMAND_OK;
+    case JSON_SHOW:
+      command.type = SHOW;
+      return COMMAND_OK;
+    case JSON_SET_BRIGHTNESS:
+      command.type = SET_BRIGHTNESS;
+      command.brightness = fields.brightness;
+      return COMMAND_OK;
+    default:
+      return COMMAND_UNHANDLED;
+    }
+  }
+
+  // Decodes a raw "[1,2,3]" colors array. With out == nullptr it only
+  // validates and counts the colors.
+  static bool scanColorList(const char *p, size_t size, uint8_t *out, uint32_t &count)
+  {
+    const char *end = p + size;
+    count = 0;
+    p = _skipWhitespace(p + 1, end); // skip '['
+    if (p < end && *p == ']')
+      return true;
+    for (;;)
+    {
+      int64_t value;
+      p = _scanInteger(p, end, value);
+      if (p == nullptr || value < 0 || value > 0xffffff)
+        return false;
+      if (out)
+      {
+        packGrb(out, value);
+        out += 3;
+      }
+      count++;
+      p = _skipWhitespace(p, end);
+      if (p < end && *p == ']')
+        return true;
+      if (p == end || *p != ',')
+        return false;
+      p = _skipWhitespace(p + 1, end);
+    }
+  }
+};
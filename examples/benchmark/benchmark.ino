@@ -0,0 +1,73 @@
+// Measures what a board and strip sustain. It times show() at boot, while
+// WiFi still connects in the background, then serves clients as soon as
+// loop() has a connection and prints throughput and latency every few
+// seconds, e.g. while extras/loadgen.py runs against it.
+#include <NeopixelCommander.h>
+
+const uint8_t PIN = 5;
+const uint16_t NUM_PIXELS = 300;
+const uint32_t REPORT_INTERVAL_MS = 5000;
+
+NeopixelCommander neopixelCommander("HomeSSID", "MySecretPass", PIN, NUM_PIXELS, 127);
+
+uint32_t lastReportMs = 0;
+uint32_t drainedCommands = 0;
+uint32_t drainTimeUs = 0;
+uint32_t loops = 0;
+
+void benchmarkShow() {
+  const uint16_t rounds = 100;
+  neopixelCommander.resetStats();
+  uint32_t start = micros();
+  for (uint16_t i = 0; i < rounds; ++i) {
+    neopixelCommander.setPixelColor(i % NUM_PIXELS, 255, i, 0);
+    neopixelCommander.invalidate(); // send the full strip every time
+    neopixelCommander.show();
+  }
+  uint32_t elapsed = micros() - start;
+  Serial.printf("show: %u pixels, avg %u us, max %u us, %u fps possible\n", NUM_PIXELS,
+                neopixelCommander.showTimeAvgUs(), neopixelCommander.showTimeMaxUs(),
+                elapsed ? (uint32_t)((uint64_t)rounds * 1000000 / elapsed) : 0);
+}
+
+// Queue latency is estimated from the deepest queue of the interval: the last
+// command in it waited for all the others to drain.
+void report(uint32_t elapsedMs) {
+  uint32_t perCommandUs = drainedCommands ? drainTimeUs / drainedCommands : 0;
+  uint16_t highWaterMark = neopixelCommander.queueHighWaterMark();
+  Serial.printf("commands %u/s, drain %u/s, %u loops/s, fps %u, show avg %u us max %u us\n",
+                drainedCommands * 1000 / elapsedMs,
+                drainTimeUs ? (uint32_t)((uint64_t)drainedCommands * 1000000 / drainTimeUs) : 0,
+                loops * 1000 / elapsedMs, neopixelCommander.framesPerSecond(),
+                neopixelCommander.showTimeAvgUs(), neopixelCommander.showTimeMaxUs());
+  Serial.printf("queue high %u of %u, latency up to %u us, heap %u\n", highWaterMark,
+                neopixelCommander.queueCapacity(), highWaterMark * perCommandUs, ESP.getFreeHeap());
+
+  neopixelCommander.resetStats();
+  drainedCommands = drainTimeUs = loops = 0;
+}
+
+void setup() {
+  Serial.begin(115200);
+  neopixelCommander.enableDdp();
+  neopixelCommander.begin();
+
+  benchmarkShow();
+  neopixelCommander.clear();
+  neopixelCommander.show();
+  neopixelCommander.resetStats();
+  lastReportMs = millis();
+}
+
+void loop() {
+  neopixelCommander.loop();
+  drainedCommands += neopixelCommander.lastDrainCount();
+  drainTimeUs += neopixelCommander.lastDrainTimeUs();
+  loops++;
+
+  uint32_t elapsedMs = millis() - lastReportMs;
+  if (elapsedMs >= REPORT_INTERVAL_MS) {
+    lastReportMs = millis();
+    report(elapsedMs);
+  }
+}
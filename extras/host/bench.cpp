@@ -0,0 +1,216 @@
+// Host microbenchmark of the command pipeline: JSON to Command conversion
+// through the same CommandParser::toCommand() the device uses, the queues and
+// the back buffer, without WiFi or LEDs. Only needs ArduinoJson 6 (header
+// only):
+//
+//   g++ -O2 -std=gnu++11 -I. -I<ArduinoJson>/src extras/host/bench.cpp -o bench && ./bench
+//
+// run from the library root. Numbers are per operation, compare them between
+// versions on the same machine.
+
+#include <chrono>
+#include <stdio.h>
+
+#include "NeopixelCommanderCore.h"
+#include "NeopixelCommanderParser.h"
+
+// Stands in for a strip, counts the shows
+class FakeOutput : public NeopixelOutput
+{
+public:
+  bool begin(uint8_t pin, uint16_t numPixels) override
+  {
+    (void)pin;
+    delete[] _pixels;
+    _pixels = new uint8_t[numPixels * 3]();
+    return true;
+  }
+
+  ~FakeOutput() { delete[] _pixels; }
+
+  uint8_t *pixels() override { return _pixels; }
+
+  void show() override
+  {
+    shows++;
+    _showComplete();
+  }
+
+  uint32_t shows = 0;
+
+private:
+  uint8_t *_pixels = nullptr;
+};
+
+static const uint16_t NUM_PIXELS = 300;
+static volatile uint32_t sink; // keeps results alive
+
+template <typename F>
+static void bench(const char *name, uint32_t iterations, F f)
+{
+  f(); // warm up
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < iterations; ++i)
+    f();
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  printf("%-36s %10.1f ns\n", name, ns / iterations);
+}
+
+// A whole strip, as _dispatchCommand() resolves it without "strip"
+static const CommandTarget TARGET = {0, NUM_PIXELS, NUM_PIXELS};
+
+static bool toCommand(const CommandFields &fields, Command &command)
+{
+  command = Command();
+  return CommandParser::toCommand(CommandParser::lookup(fields.cmd, fields.cmdLength), fields, TARGET, command) ==
+         COMMAND_OK;
+}
+
+static void benchParser()
+{
+  static const char *messages[][2] = {
+      {"setPixelColor", "{\"cmd\":\"setPixelColor\",\"id\":7,\"index\":2,\"r\":255,\"g\":0,\"b\":0}"},
+      {"fillRange", "{\"cmd\":\"fillRange\",\"id\":8,\"start\":10,\"count\":20,\"color\":\"ff8000\"}"},
+      {"show", "{\"cmd\":\"show\",\"id\":9}"},
+  };
+  char name[64];
+  for (const auto &message : messages)
+  {
+    const char *text = message[1];
+    size_t len = strlen(text);
+
+    snprintf(name, sizeof(name), "scan %s", message[0]);
+    bench(name, 200000, [&]() {
+      CommandFields fields;
+      Command command;
+      sink = CommandParser::scan(text, len, fields) && toCommand(fields, command) ? command.index : 0;
+    });
+
+    snprintf(name, sizeof(name), "deserializeJson %s", message[0]);
+    bench(name, 200000, [&]() {
+      StaticJsonDocument<1024> doc;
+      CommandFields fields;
+      Command command;
+      if (deserializeJson(doc, text, len) == DeserializationError::Ok)
+      {
+        CommandParser::fromDocument(doc, fields);
+        sink = toCommand(fields, command) ? command.index : 0;
+      }
+    });
+  }
+
+  // 64 pixels as "colors" array and as hex string
+  static char colors[1024], hex[512];
+  int n = snprintf(colors, sizeof(colors), "[");
+  for (int i = 0; i < 64; ++i)
+    n += snprintf(colors + n, sizeof(colors) - n, i ? ",%d" : "%d", i * 0x020304);
+  snprintf(colors + n, sizeof(colors) - n, "]");
+  for (int i = 0; i < 64; ++i)
+    snprintf(hex + i * 6, 7, "%06x", i * 0x020304);
+
+  uint8_t grb[64 * 3];
+  bench("scanColorList 64 pixels", 100000, [&]() {
+    uint32_t count;
+    sink = CommandParser::scanColorList(colors, strlen(colors), grb, count) ? count : 0;
+  });
+  bench("parseHexColor 64 pixels", 100000, [&]() {
+    for (int i = 0; i < 64; ++i)
+    {
+      uint32_t color;
+      if (CommandParser::parseHexColor(hex + i * 6, 6, color))
+        CommandParser::packGrb(grb + i * 3, color);
+    }
+    sink = grb[0];
+  });
+}
+
+static void benchQueues()
+{
+  SpscQueue<Command> queue;
+  queue.allocate(COMMAND_QUEUE_SIZE, false);
+  Command command = Command();
+  bench("SpscQueue push + pop", 1000000, [&]() {
+    queue.push(command);
+    Command out;
+    sink = queue.pop(out);
+  });
+  bench("SpscQueue 256 push, 256 pop", 10000, [&]() {
+    for (uint16_t i = 0; i < 256; ++i)
+    {
+      command.index = i;
+      queue.push(command);
+    }
+    Command out;
+    while (queue.pop(out))
+      sink = out.index;
+  });
+
+  ScheduleQueue<Command, 64> schedule;
+  bench("ScheduleQueue 64 push, 64 popDue", 10000, [&]() {
+    for (uint16_t i = 0; i < 64; ++i)
+    {
+      command.at = (i * 37) % 64 + 1;
+      schedule.push(command);
+    }
+    Command out;
+    while (schedule.popDue(100, out))
+      sink = out.at;
+  });
+}
+
+static void benchBuffer()
+{
+  PixelBuffer frame;
+  frame.resize(NUM_PIXELS);
+  FakeOutput output;
+  output.begin(0, NUM_PIXELS);
+  uint8_t data[NUM_PIXELS * 3];
+  for (uint16_t i = 0; i < sizeof(data); ++i)
+    data[i] = i;
+  static const uint8_t grb[3] = {1, 0, 2};
+  static const uint8_t rgb[3] = {0, 1, 2};
+  uint8_t balance[3] = {255, 255, 255};
+  ColorLut lut;
+
+  bench("PixelBuffer fill 300", 100000, [&]() {
+    frame.fill(0, NUM_PIXELS, 1, 2, 3);
+    frame.clean();
+  });
+  bench("PixelBuffer set 300", 100000, [&]() {
+    for (uint16_t i = 0; i < NUM_PIXELS; ++i)
+      frame.set(i, i, 0, 0);
+    frame.clean();
+  });
+  bench("PixelBuffer write 300", 100000, [&]() {
+    frame.write(0, NUM_PIXELS, data);
+    frame.clean();
+  });
+  bench("PixelBuffer applyXor 300", 100000, [&]() {
+    frame.applyXor(0, NUM_PIXELS, data);
+    frame.clean();
+  });
+
+  lut.build(255, false, balance);
+  bench("ColorLut apply 300, identity", 100000, [&]() {
+    lut.apply(output.pixels(), frame.data(), NUM_PIXELS, grb);
+    output.show();
+  });
+  lut.build(127, true, balance);
+  bench("ColorLut apply 300, gamma + RGB", 100000, [&]() {
+    lut.apply(output.pixels(), frame.data(), NUM_PIXELS, rgb);
+    output.show();
+  });
+  bench("ColorLut build", 100000, [&]() {
+    lut.build(127, true, balance);
+    sink = lut.identity();
+  });
+  sink = output.shows;
+}
+
+int main()
+{
+  benchParser();
+  benchQueues();
+  benchBuffer();
+  return 0;
+}
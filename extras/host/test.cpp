@@ -0,0 +1,372 @@
+// Host unit tests of the platform independent parts: the JSON scanner
+// against ArduinoJson, the field to Command mapping, the queues, the back
+// buffer and the color table. Needs ArduinoJson 6 (header only):
+//
+//   g++ -std=gnu++11 -Wall -Wextra -I. -I<ArduinoJson>/src extras/host/test.cpp -o test && ./test
+//
+// run from the library root. Prints the failed checks and exits with 1 if
+// there are any.
+
+#include <stdio.h>
+
+#include "NeopixelCommanderCore.h"
+#include "NeopixelCommanderParser.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                  \
+  do                                                                      \
+  {                                                                       \
+    if (!(condition))                                                     \
+    {                                                                     \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      failures++;                                                         \
+    }                                                                     \
+  } while (0)
+
+static bool sameString(const char *a, size_t aLength, const char *b, size_t bLength)
+{
+  if (a == nullptr || b == nullptr)
+    return a == b;
+  return aLength == bLength && memcmp(a, b, aLength) == 0;
+}
+
+// The scanner has to agree with the ArduinoJson fallback on everything it
+// accepts
+static void testScanner()
+{
+  static const char *accepted[] = {
+      "{\"cmd\":\"setPixelColor\",\"id\":7,\"index\":2,\"r\":255,\"g\":0,\"b\":0}",
+      " { \"cmd\" : \"fillRange\" , \"id\" : 8 , \"start\" : 10 , \"count\" : 20 , \"color\" : \"ff8000\" } ",
+      "{\"cmd\":\"fillRange\",\"id\":9,\"start\":0,\"count\":3,\"color\":\"#00FF7f\"}",
+      "{\"cmd\":\"fillRange\",\"id\":10,\"start\":0,\"count\":3,\"color\":16744448}",
+      "{\"cmd\":\"fillRange\",\"id\":11,\"start\":0,\"count\":3,\"color\":\"red\"}",
+      "{\"cmd\":\"fillRange\",\"id\":12,\"count\":3,\"color\":16777216}",
+      "{\"cmd\":\"setPixels\",\"id\":13,\"start\":4,\"hex\":\"ff000000ff00\",\"show\":true}",
+      "{\"cmd\":\"setColor\",\"id\":14,\"strip\":1,\"r\":1,\"g\":2,\"b\":3,\"at\":4294967295}",
+      "{\"cmd\":\"setColor\",\"id\":15,\"segment\":\"shelf\",\"noAck\":true,\"r\":-1}",
+      "{\"cmd\":\"clear\",\"id\":16,\"segment\":2,\"extra\":{\"a\":[1,2,{\"b\":\"}\"}]}}",
+      "{\"cmd\":\"syncTime\",\"id\":17,\"time\":123456}",
+      "{\"cmd\":\"setBrightness\",\"id\":18,\"brightness\":64,\"name\":\"x\\\"y\"}",
+      "{\"cmd\":\"fadeTo\",\"id\":19,\"duration\":500,\"start\":1,\"count\":2,\"color\":255}",
+      "{}",
+  };
+  for (const char *text : accepted)
+  {
+    size_t len = strlen(text);
+    CommandFields scanned;
+    bool ok = CommandParser::scan(text, len, scanned);
+    CHECK(ok);
+    if (!ok)
+    {
+      printf("  %s\n", text);
+      continue;
+    }
+
+    StaticJsonDocument<1024> doc;
+    CHECK(deserializeJson(doc, (const char *)text, len) == DeserializationError::Ok);
+    CommandFields parsed;
+    CommandParser::fromDocument(doc, parsed);
+
+    CHECK(sameString(scanned.cmd, scanned.cmdLength, parsed.cmd, parsed.cmdLength));
+    CHECK(scanned.id == parsed.id);
+    CHECK(scanned.strip == parsed.strip);
+    CHECK(scanned.segment == parsed.segment);
+    CHECK(sameString(scanned.segmentName, scanned.segmentNameLength, parsed.segmentName,
+                     parsed.segmentNameLength));
+    CHECK(scanned.index == parsed.index);
+    CHECK(scanned.r == parsed.r);
+    CHECK(scanned.g == parsed.g);
+    CHECK(scanned.b == parsed.b);
+    CHECK(scanned.brightness == parsed.brightness);
+    CHECK(scanned.start == parsed.start);
+    CHECK(scanned.count == parsed.count);
+    CHECK(scanned.duration == parsed.duration);
+    CHECK(scanned.at == parsed.at);
+    CHECK(scanned.hasTime == parsed.hasTime);
+    CHECK(scanned.time == parsed.time);
+    CHECK(scanned.show == parsed.show);
+    CHECK(scanned.noAck == parsed.noAck);
+    CHECK(scanned.hasColor == parsed.hasColor);
+    CHECK(scanned.badColor == parsed.badColor);
+    CHECK(scanned.color == parsed.color);
+    CHECK(sameString(scanned.hex, scanned.hexLength, parsed.hex, parsed.hexLength));
+  }
+
+  // Left to ArduinoJson
+  static const char *rejected[] = {
+      "{\"cmd\":\"set\\u0050ixelColor\",\"id\":1}",
+      "{\"cmd\":\"setPixelColor\",\"id\":1,\"r\":1.5}",
+      "{\"cmd\":\"setPixelColor\",\"id\":1,\"r\":1e2}",
+      "{\"cmd\":\"setPixelColor\",\"id\":-1}",
+      "{\"cmd\":\"setPixelColor\",\"id\":1,\"r\":\"1\"}",
+      "{\"cmd\":\"show\",\"id\":1",
+      "{\"cmd\":\"show\",\"id\":1}x",
+      "[1,2]",
+      "",
+  };
+  for (const char *text : rejected)
+  {
+    CommandFields fields;
+    bool ok = CommandParser::scan(text, strlen(text), fields);
+    CHECK(!ok);
+    if (ok)
+      printf("  %s\n", text);
+  }
+
+  uint8_t grb[6];
+  uint32_t count;
+  CHECK(CommandParser::scanColorList("[16711680, 255]", 15, grb, count) && count == 2);
+  CHECK(grb[0] == 0 && grb[1] == 0xff && grb[2] == 0 && grb[3] == 0 && grb[4] == 0 && grb[5] == 0xff);
+  CHECK(CommandParser::scanColorList("[]", 2, nullptr, count) && count == 0);
+  CHECK(!CommandParser::scanColorList("[16777216]", 10, nullptr, count));
+  CHECK(!CommandParser::scanColorList("[1,]", 4, nullptr, count));
+}
+
+static void testToCommand()
+{
+  CommandTarget strip = {100, 50, 50};
+  Command command = {};
+  CommandFields fields;
+
+  const char *text = "{\"cmd\":\"setPixelColor\",\"id\":3,\"index\":49,\"r\":1,\"g\":2,\"b\":3,\"noAck\":true}";
+  CHECK(CommandParser::scan(text, strlen(text), fields));
+  CHECK(CommandParser::toCommand(JSON_SET_PIXEL_COLOR, fields, strip, command) == COMMAND_OK);
+  CHECK(command.type == SET_PIXEL_COLOR && command.index == 149 && command.commandId == 3);
+  CHECK(command.r == 1 && command.g == 2 && command.b == 3 && command.flags == BIN_FLAG_NO_ACK);
+  fields.index = 50;
+  CHECK(CommandParser::toCommand(JSON_SET_PIXEL_COLOR, fields, strip, command) == COMMAND_BAD_INDEX);
+  fields.index = -1;
+  CHECK(CommandParser::toCommand(JSON_SET_PIXEL_COLOR, fields, strip, command) == COMMAND_BAD_INDEX);
+
+  fields = CommandFields();
+  fields.start = 40;
+  fields.count = 10;
+  fields.hasColor = true;
+  fields.color = 0x102030;
+  fields.at = 1234;
+  CHECK(CommandParser::toCommand(JSON_FILL_RANGE, fields, strip, command) == COMMAND_OK);
+  CHECK(command.type == SET_COLOR && command.index == 140 && command.count == 10 && command.at == 1234);
+  CHECK(command.r == 0x10 && command.g == 0x20 && command.b == 0x30 && command.flags == 0);
+  fields.count = 11;
+  CHECK(CommandParser::toCommand(JSON_FILL_RANGE, fields, strip, command) == COMMAND_BAD_INDEX);
+  fields.count = 0;
+  CHECK(CommandParser::toCommand(JSON_FILL_RANGE, fields, strip, command) == COMMAND_BAD_INDEX);
+  // Sums that overflow int32 must not pass the range check
+  fields.start = 1;
+  fields.count = INT32_MAX;
+  CHECK(CommandParser::toCommand(JSON_FILL_RANGE, fields, strip, command) == COMMAND_BAD_INDEX);
+  fields.start = INT32_MAX;
+  fields.count = 1;
+  CHECK(CommandParser::toCommand(JSON_FILL_RANGE, fields, strip, command) == COMMAND_BAD_INDEX);
+  fields.start = INT32_MAX;
+  fields.count = INT32_MAX;
+  CHECK(CommandParser::toCommand(JSON_FILL_RANGE, fields, strip, command) == COMMAND_BAD_INDEX);
+  fields.start = 50;
+  fields.count = 1;
+  CHECK(CommandParser::toCommand(JSON_FILL_RANGE, fields, strip, command) == COMMAND_BAD_INDEX);
+  fields.start = 0;
+  fields.count = 50;
+  CHECK(CommandParser::toCommand(JSON_FILL_RANGE, fields, strip, command) == COMMAND_OK);
+  CHECK(command.index == 100 && command.count == 50);
+
+  fields.count = 1;
+  fields.hasColor = false;
+  fields.badColor = true;
+  CHECK(CommandParser::toCommand(JSON_FILL_RANGE, fields, strip, command) == COMMAND_BAD_COLOR);
+
+  // A full fill covers the span, mirrored halves included
+  CommandTarget mirrored = {10, 5, 9};
+  CHECK(CommandParser::toCommand(JSON_CLEAR, fields, mirrored, command) == COMMAND_OK);
+  CHECK(command.type == CLEAR && command.index == 10 && command.count == 9);
+
+  fields.brightness = 7;
+  CHECK(CommandParser::toCommand(JSON_SET_BRIGHTNESS, fields, strip, command) == COMMAND_OK);
+  CHECK(command.type == SET_BRIGHTNESS && command.brightness == 7);
+
+  fields.id = 99;
+  CHECK(CommandParser::toCommand(JSON_SET_PIXELS, fields, strip, command) == COMMAND_UNHANDLED);
+  CHECK(command.commandId == 99);
+}
+
+// The range check of fillRange, fadeTo, startEffect and stopEffect
+static void testRangeFits()
+{
+  CHECK(CommandParser::rangeFits(0, 50, 50));
+  CHECK(CommandParser::rangeFits(49, 1, 50));
+  CHECK(CommandParser::rangeFits(50, 0, 50));
+  CHECK(!CommandParser::rangeFits(50, 1, 50));
+  CHECK(!CommandParser::rangeFits(0, 51, 50));
+  CHECK(!CommandParser::rangeFits(-1, 1, 50));
+  CHECK(!CommandParser::rangeFits(1, -1, 50));
+  CHECK(!CommandParser::rangeFits(1, INT32_MAX, 50));
+  CHECK(!CommandParser::rangeFits(INT32_MAX, 1, 50));
+  CHECK(!CommandParser::rangeFits(INT32_MAX, INT32_MAX, 65535));
+  CHECK(!CommandParser::rangeFits(INT32_MIN, INT32_MAX, 65535));
+  CHECK(CommandParser::rangeFits(0, 65535, 65535));
+}
+
+static void testSpscQueue()
+{
+  SpscQueue<Command> queue;
+  CHECK(queue.allocate(3, false));
+  CHECK(queue.capacity() == 4);
+
+  // Runs the 16 bit indices around several times
+  Command command = {};
+  uint32_t pushed = 0, popped = 0;
+  for (uint32_t round = 0; round < 70000; ++round)
+  {
+    uint16_t n = 1 + round % 4;
+    for (uint16_t i = 0; i < n; ++i)
+    {
+      command.commandId = pushed++;
+      CHECK(queue.push(command));
+    }
+    CHECK(queue.depth() == n);
+    if (n == 4)
+      CHECK(!queue.push(command));
+    Command out;
+    while (queue.pop(out))
+    {
+      if (out.commandId != popped)
+      {
+        CHECK(out.commandId == popped);
+        return;
+      }
+      popped++;
+    }
+    CHECK(queue.empty());
+  }
+  CHECK(pushed == popped);
+  CHECK(queue.highWaterMark() == 4);
+
+  // Producer side rewrites
+  for (uint32_t i = 0; i < 3; ++i)
+  {
+    command.commandId = i;
+    queue.push(command);
+  }
+  CHECK(queue.pending(0)->commandId == 2 && queue.pending(2)->commandId == 0 && queue.pending(3) == nullptr);
+  queue.dropNewest(2);
+  CHECK(queue.depth() == 1 && queue.pending(0)->commandId == 0);
+}
+
+static void testScheduleQueue()
+{
+  ScheduleQueue<Command, 8> schedule;
+  Command command = {};
+  Command out;
+
+  // Same times keep their order, times wrap around
+  static const uint32_t times[] = {5, 0xfffffff0u, 5, 3, 0xffffffffu, 3, 100, 5};
+  for (uint8_t i = 0; i < 8; ++i)
+  {
+    command.at = times[i];
+    command.commandId = i;
+    CHECK(schedule.push(command));
+  }
+  CHECK(!schedule.push(command));
+
+  CHECK(!schedule.popDue(0xffffffefu, out));
+  static const uint32_t expected[] = {1, 4, 3, 5, 0, 2, 7};
+  for (uint32_t id : expected)
+  {
+    CHECK(schedule.popDue(50, out));
+    CHECK(out.commandId == id);
+  }
+  CHECK(!schedule.popDue(99, out));
+  CHECK(schedule.popDue(100, out) && out.commandId == 6);
+  CHECK(schedule.size() == 0);
+}
+
+static void testPixelBuffer()
+{
+  PixelBuffer frame;
+  frame.resize(10);
+  CHECK(frame.dirty() && frame.dirtyFirst() == 0 && frame.dirtyEnd() == 10);
+  frame.clean();
+  CHECK(!frame.dirty());
+
+  frame.set(4, 1, 2, 3);
+  CHECK(frame.dirtyFirst() == 4 && frame.dirtyEnd() == 5);
+  CHECK(frame.data()[12] == 2 && frame.data()[13] == 1 && frame.data()[14] == 3);
+  frame.fill(7, 2, 9, 9, 9);
+  CHECK(frame.dirtyFirst() == 4 && frame.dirtyEnd() == 9);
+  frame.clear(1, 1);
+  CHECK(frame.dirtyFirst() == 1 && frame.dirtyEnd() == 9);
+  frame.markDirty(3, 0);
+  CHECK(frame.dirtyFirst() == 1 && frame.dirtyEnd() == 9);
+  frame.clean();
+
+  // Only pixels the delta changes become dirty
+  uint8_t delta[5 * 3] = {};
+  delta[3 * 1 + 2] = 0xff;
+  delta[3 * 3] = 0x01;
+  frame.applyXor(5, 5, delta);
+  CHECK(frame.dirtyFirst() == 6 && frame.dirtyEnd() == 9);
+  CHECK(frame.data()[6 * 3 + 2] == 0xff);
+  frame.clean();
+  memset(delta, 0, sizeof(delta));
+  frame.applyXor(0, 5, delta);
+  CHECK(!frame.dirty());
+
+  uint8_t grb[6] = {1, 2, 3, 4, 5, 6};
+  frame.write(8, 2, grb);
+  CHECK(frame.dirtyFirst() == 8 && frame.dirtyEnd() == 10 && memcmp(frame.data() + 24, grb, 6) == 0);
+
+  // Growing keeps the pixels
+  frame.resize(12);
+  CHECK(frame.size() == 12 && memcmp(frame.data() + 24, grb, 6) == 0 && frame.data()[33] == 0);
+}
+
+static void testColorLut()
+{
+  static const uint8_t grb[3] = {1, 0, 2};
+  static const uint8_t rgb[3] = {0, 1, 2};
+  uint8_t balance[3] = {255, 255, 255};
+  uint8_t in[2 * 3] = {10, 200, 30, 255, 0, 128};
+  uint8_t out[2 * 3];
+  ColorLut lut;
+
+  lut.build(255, false, balance);
+  CHECK(lut.identity());
+  lut.apply(out, in, 2, grb);
+  CHECK(memcmp(out, in, sizeof(in)) == 0);
+  lut.apply(out, in, 2, rgb);
+  CHECK(out[0] == 200 && out[1] == 10 && out[2] == 30);
+
+  lut.build(127, false, balance);
+  CHECK(!lut.identity());
+  lut.apply(out, in, 2, grb);
+  CHECK(out[0] == 5 && out[1] == 100 && out[2] == 15 && out[3] == 127 && out[4] == 0 && out[5] == 64);
+
+  lut.build(255, true, balance);
+  lut.apply(out, in, 2, grb);
+  CHECK(out[0] == 0 && out[1] == 136 && out[2] == 1 && out[3] == 255 && out[5] == 42);
+
+  // White balance scales a single channel
+  uint8_t warm[3] = {255, 255, 127};
+  lut.build(255, false, warm);
+  CHECK(!lut.identity());
+  lut.apply(out, in, 2, grb);
+  CHECK(out[0] == 10 && out[1] == 200 && out[2] == 15 && out[5] == 64);
+}
+
+int main()
+{
+  testScanner();
+  testToCommand();
+  testRangeFits();
+  testSpscQueue();
+  testScheduleQueue();
+  testPixelBuffer();
+  testColorLut();
+  if (failures)
+  {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
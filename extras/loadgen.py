@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+"""Load generator for NeopixelCommander.
+
+Streams a workload at a fixed rate and reports throughput and ack round trip
+percentiles, e.g. to qualify a firmware version or compare protocol modes:
+
+    pip install websockets
+    python3 loadgen.py 192.168.1.50 --mode json-pixel --rate 500 --duration 10
+    python3 loadgen.py 192.168.1.50 --mode binary --rate 60 --pixels 300
+    python3 loadgen.py 192.168.1.50 --mode ddp --rate 60 --pixels 300
+
+Modes:
+    json-pixel  setPixelColor, one pixel per message
+    json-frame  setPixels with a hex string for all pixels, shown
+    binary      binary setPixels (opcode 0x01) for all pixels, shown
+    ddp         DDP over UDP, never acked, getStats is sampled instead
+
+The ack mode of the device (ack, acks or ackUpTo) is detected from the
+replies. Messages sent with --no-ack are counted but not timed.
+"""
+
+import argparse
+import asyncio
+import json
+import socket
+import struct
+import time
+
+try:
+    import websockets
+except ImportError:
+    websockets = None
+
+DDP_PORT = 4048
+DDP_MAX_DATA = 1440
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    k = (len(sorted_values) - 1) * p / 100.0
+    lo = int(k)
+    hi = min(lo + 1, len(sorted_values) - 1)
+    return sorted_values[lo] + (sorted_values[hi] - sorted_values[lo]) * (k - lo)
+
+
+def frame_bytes(pixels, tick):
+    """A moving gradient, so every frame differs from the one before."""
+    out = bytearray(pixels * 3)
+    for i in range(pixels):
+        v = (i * 256 // max(pixels, 1) + tick * 4) & 0xFF
+        out[i * 3:i * 3 + 3] = bytes((v, 255 - v, (v * 2) & 0xFF))  # G, R, B
+    return bytes(out)
+
+
+class Stats:
+    def __init__(self):
+        self.sent = 0
+        self.acked = 0
+        self.errors = {}
+        self.pending = {}  # id -> send time
+        self.rtts = []
+
+    def ack(self, command_id, now):
+        sent = self.pending.pop(command_id, None)
+        if sent is not None:
+            self.acked += 1
+            self.rtts.append((now - sent) * 1000.0)
+
+    def ack_up_to(self, command_id, now):
+        for pending_id in [i for i in self.pending if i <= command_id]:
+            self.ack(pending_id, now)
+
+    def error(self, name, command_id):
+        self.errors[name] = self.errors.get(name, 0) + 1
+        self.pending.pop(command_id, None)
+
+
+async def receive(ws, stats):
+    async for message in ws:
+        if isinstance(message, bytes):
+            continue
+        now = time.perf_counter()
+        try:
+            reply = json.loads(message)
+        except ValueError:
+            continue
+        if "ack" in reply:
+            stats.ack(reply["ack"], now)
+        elif "acks" in reply:
+            for command_id in reply["acks"]:
+                stats.ack(command_id, now)
+        elif "ackUpTo" in reply:
+            stats.ack_up_to(reply["ackUpTo"], now)
+        elif reply.get("status") == "error":
+            stats.error(reply.get("error", "unknown"), reply.get("id"))
+
+
+def build_message(mode, command_id, tick, pixels, no_ack):
+    if mode == "json-pixel":
+        message = {"cmd": "setPixelColor", "id": command_id, "index": tick % pixels,
+                   "r": tick & 0xFF, "g": 0, "b": 255 - (tick & 0xFF)}
+    elif mode == "json-frame":
+        grb = frame_bytes(pixels, tick)
+        rgb = bytes(b for i in range(0, len(grb), 3) for b in (grb[i + 1], grb[i], grb[i + 2]))
+        message = {"cmd": "setPixels", "id": command_id, "hex": rgb.hex(), "show": True}
+    else:
+        flags = 0x01 | (0x02 if no_ack else 0)
+        return struct.pack("<BBHHI", 0x01, flags, 0, pixels, command_id) + frame_bytes(pixels, tick)
+    if no_ack:
+        message["noAck"] = True
+    return json.dumps(message, separators=(",", ":"))
+
+
+async def run_websocket(args):
+    if websockets is None:
+        raise SystemExit("the websockets package is required: pip install websockets")
+    stats = Stats()
+    async with websockets.connect("ws://%s/ws" % args.host, max_size=None) as ws:
+        receiver = asyncio.ensure_future(receive(ws, stats))
+        interval = 1.0 / args.rate
+        start = time.perf_counter()
+        next_send = start
+        tick = 0
+        while time.perf_counter() - start < args.duration:
+            command_id = tick + 1
+            message = build_message(args.mode, command_id, tick, args.pixels, args.no_ack)
+            if not args.no_ack:
+                stats.pending[command_id] = time.perf_counter()
+            await ws.send(message)
+            stats.sent += 1
+            tick += 1
+            next_send += interval
+            delay = next_send - time.perf_counter()
+            if delay > 0:
+                await asyncio.sleep(delay)
+        elapsed = time.perf_counter() - start
+
+        # Give the last acks a moment to arrive
+        deadline = time.perf_counter() + 2.0
+        while stats.pending and time.perf_counter() < deadline:
+            await asyncio.sleep(0.05)
+        device = await fetch_stats(ws, receiver)
+    report(args, stats, elapsed, device)
+
+
+async def fetch_stats(ws, receiver):
+    receiver.cancel()
+    try:
+        await receiver
+    except asyncio.CancelledError:
+        pass
+    await ws.send('{"cmd":"getStats"}')
+    try:
+        while True:
+            reply = json.loads(await asyncio.wait_for(ws.recv(), 2.0))
+            if "stats" in reply:
+                return reply["stats"]
+    except (asyncio.TimeoutError, ValueError):
+        return None
+
+
+def run_ddp(args):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    stats = Stats()
+    interval = 1.0 / args.rate
+    start = time.perf_counter()
+    next_send = start
+    tick = 0
+    while time.perf_counter() - start < args.duration:
+        grb = frame_bytes(args.pixels, tick)
+        rgb = bytes(b for i in range(0, len(grb), 3) for b in (grb[i + 1], grb[i], grb[i + 2]))
+        for offset in range(0, len(rgb), DDP_MAX_DATA):
+            chunk = rgb[offset:offset + DDP_MAX_DATA]
+            last = offset + DDP_MAX_DATA >= len(rgb)
+            flags = 0x40 | (0x01 if last else 0)  # version 1, push on the last packet
+            header = struct.pack(">BBBBIH", flags, tick & 0x0F, 0x0B, 1, offset, len(chunk))
+            sock.sendto(header + chunk, (args.host, args.port or DDP_PORT))
+            stats.sent += 1
+        tick += 1
+        next_send += interval
+        delay = next_send - time.perf_counter()
+        if delay > 0:
+            time.sleep(delay)
+    elapsed = time.perf_counter() - start
+
+    device = None
+    if websockets is not None:
+        async def query():
+            async with websockets.connect("ws://%s/ws" % args.host, max_size=None) as ws:
+                await ws.send('{"cmd":"getStats"}')
+                reply = json.loads(await asyncio.wait_for(ws.recv(), 2.0))
+                return reply.get("stats")
+        try:
+            device = asyncio.run(query())
+        except (OSError, asyncio.TimeoutError, ValueError):
+            pass
+    report(args, stats, elapsed, device, frames=tick)
+
+
+def report(args, stats, elapsed, device, frames=None):
+    print("mode %s, %d pixels, target %.0f msg/s for %.1f s" % (args.mode, args.pixels, args.rate, elapsed))
+    print("sent %d (%.1f/s)" % (stats.sent, stats.sent / elapsed if elapsed else 0))
+    if frames is not None:
+        print("frames %d (%.1f/s), UDP is not acked" % (frames, frames / elapsed if elapsed else 0))
+    elif not args.no_ack:
+        rtts = sorted(stats.rtts)
+        print("acked %d, lost %d" % (stats.acked, len(stats.pending)))
+        if rtts:
+            print("ack rtt ms: p50 %.2f  p90 %.2f  p99 %.2f  max %.2f" % (
+                percentile(rtts, 50), percentile(rtts, 90), percentile(rtts, 99), rtts[-1]))
+    if stats.errors:
+        print("errors: " + ", ".join("%s %d" % item for item in sorted(stats.errors.items())))
+    if device:
+        keys = ("fps", "frames", "showsSkipped", "showAvgUs", "showMaxUs", "queueHighWaterMark",
+                "queueFull", "rateLimited", "coalesced", "framesDropped", "udpPackets", "badUdp")
+        print("device: " + ", ".join("%s %s" % (key, device[key]) for key in keys if key in device))
+    if args.json:
+        result = {"mode": args.mode, "pixels": args.pixels, "rate": args.rate, "elapsed": elapsed,
+                  "sent": stats.sent, "acked": stats.acked, "lost": len(stats.pending),
+                  "errors": stats.errors, "device": device}
+        rtts = sorted(stats.rtts)
+        for p in (50, 90, 99):
+            result["p%d" % p] = percentile(rtts, p)
+        with open(args.json, "w") as f:
+            json.dump(result, f, indent=2)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host", help="device address")
+    parser.add_argument("--mode", choices=("json-pixel", "json-frame", "binary", "ddp"), default="json-pixel")
+    parser.add_argument("--rate", type=float, default=100, help="messages (frames for ddp) per second")
+    parser.add_argument("--duration", type=float, default=10, help="seconds")
+    parser.add_argument("--pixels", type=int, default=64, help="pixels per frame, or range for json-pixel")
+    parser.add_argument("--port", type=int, help="UDP port for ddp")
+    parser.add_argument("--no-ack", action="store_true", help="send fire-and-forget messages")
+    parser.add_argument("--json", metavar="FILE", help="also write the results to FILE")
+    args = parser.parse_args()
+
+    if args.mode == "ddp":
+        run_ddp(args)
+    else:
+        asyncio.run(run_websocket(args))
+
+
+if __name__ == "__main__":
+    main()